@@ -0,0 +1,227 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./archiver/src/archive.cpp
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "archive.h"
+
+#include <QIODevice>
+#include <QDateTime>
+#include <QDebug>
+
+CsvWriter::CsvWriter(QIODevice* dev)
+  : m_stream(dev) {
+  m_stream.setRealNumberPrecision(7);
+  m_stream << Header << '\n';
+}
+
+void CsvWriter::write(const QString& address, const QString& metric, const Measurement& m) {
+  m_stream << address << ',' << metric << ',' << m.ts << ',' << m.value << '\n';
+}
+
+void CsvWriter::finish() {
+  m_stream.flush();
+}
+
+
+BinaryWriter::BinaryWriter(QIODevice* dev)
+  : m_stream(dev) {
+  m_stream.setVersion(QDataStream::Qt_5_15);
+  m_stream.setByteOrder(QDataStream::BigEndian);
+  m_stream.setFloatingPointPrecision(QDataStream::SinglePrecision);
+  m_stream << Magic << Version;
+  m_chunk.reserve(ChunkSize);
+}
+
+void BinaryWriter::write(const QString& address, const QString& metric, const Measurement& m) {
+  if (address != m_address || metric != m_metric) {
+    flush();
+    m_address = address;
+    m_metric = metric;
+    m_stream << TagSeries << m_address << m_metric;
+  }
+  m_chunk << m;
+  if (m_chunk.size() == ChunkSize) {
+    flush();
+  }
+}
+
+void BinaryWriter::flush() {
+  if (m_chunk.isEmpty()) return;
+  m_stream << TagChunk << static_cast<quint16>(m_chunk.size());
+  for (const Measurement& m: m_chunk) {
+    m_stream << m.ts << m.value;
+  }
+  m_chunk.clear();
+}
+
+void BinaryWriter::finish() {
+  flush();
+  m_stream << TagEnd;
+}
+
+
+void readCsv(QIODevice* dev, const SampleVisitor& visitor) {
+  QTextStream stream(dev);
+  QString line;
+  int lineno = 0;
+  while (stream.readLineInto(&line)) {
+    lineno++;
+    if (line.isEmpty() || line == CsvWriter::Header) continue;
+
+    const auto fields = line.splitRef(',');
+    if (fields.size() != 4) {
+      throw FormatError(QString("line %1: expected 4 fields").arg(lineno));
+    }
+    bool ok1;
+    bool ok2;
+    const quint32 ts = fields[2].toUInt(&ok1);
+    const float value = fields[3].toFloat(&ok2);
+    if (!ok1 || !ok2) {
+      throw FormatError(QString("line %1: invalid timestamp or value").arg(lineno));
+    }
+    visitor(fields[0].toString(), fields[1].toString(), Measurement(ts, value));
+  }
+}
+
+void readBinary(QIODevice* dev, const SampleVisitor& visitor) {
+  QDataStream stream(dev);
+  stream.setVersion(QDataStream::Qt_5_15);
+  stream.setByteOrder(QDataStream::BigEndian);
+  stream.setFloatingPointPrecision(QDataStream::SinglePrecision);
+
+  quint32 magic;
+  quint8 version;
+  stream >> magic >> version;
+  if (magic != BinaryWriter::Magic || version != BinaryWriter::Version) {
+    throw FormatError("not a kruuvi archive");
+  }
+
+  QString address;
+  QString metric;
+  while (true) {
+    quint8 tag;
+    stream >> tag;
+    if (stream.status() != QDataStream::Ok) {
+      throw FormatError("truncated archive");
+    }
+    if (tag == BinaryWriter::TagEnd) {
+      return;
+    }
+    if (tag == BinaryWriter::TagSeries) {
+      stream >> address >> metric;
+    } else if (tag == BinaryWriter::TagChunk) {
+      if (address.isEmpty()) {
+        throw FormatError("chunk without series");
+      }
+      quint16 n;
+      stream >> n;
+      for (quint16 i = 0; i < n && stream.status() == QDataStream::Ok; i++) {
+        quint32 ts;
+        float value;
+        stream >> ts >> value;
+        visitor(address, metric, Measurement(ts, value));
+      }
+    } else {
+      throw FormatError(QString("unknown record %1").arg(tag));
+    }
+  }
+}
+
+static QString unquoted(const QString& field) {
+  auto f = field.trimmed();
+  if (f.size() >= 2 && f.startsWith('"') && f.endsWith('"')) {
+    f = f.mid(1, f.size() - 2);
+  }
+  return f;
+}
+
+static bool parseTime(const QString& s, quint32& ts) {
+  bool ok;
+  const qint64 n = s.toLongLong(&ok);
+  if (ok) {
+    // seconds or milliseconds since epoch
+    ts = n > 10000000000LL ? n / 1000 : n;
+    return true;
+  }
+
+  auto dt = QDateTime::fromString(s, Qt::ISODate);
+  for (const char* fmt: {"yyyy-MM-dd HH:mm:ss", "yyyy/MM/dd HH:mm:ss", "dd.MM.yyyy HH:mm:ss"}) {
+    if (dt.isValid()) break;
+    dt = QDateTime::fromString(s, fmt);
+  }
+  if (!dt.isValid()) return false;
+
+  ts = dt.toSecsSinceEpoch();
+  return true;
+}
+
+void readStationCsv(QIODevice* dev, const QString& address, const SampleVisitor& visitor) {
+  QTextStream stream(dev);
+  QString header;
+  if (!stream.readLineInto(&header)) {
+    throw FormatError("empty file");
+  }
+  const QChar sep = header.count(';') > header.count(',') ? ';' : ',';
+
+  struct Column {
+    int index;
+    QString metric;
+    double scale;
+  };
+  QVector<Column> columns;
+  int timeColumn = -1;
+
+  const auto names = header.split(sep);
+  for (int i = 0; i < names.size(); i++) {
+    const auto name = unquoted(names[i]).toLower();
+    if (timeColumn < 0 && (name.startsWith("date") || name.startsWith("time"))) {
+      timeColumn = i;
+      continue;
+    }
+    for (const Metric& metric: Metrics::all) {
+      if (name.startsWith(QLatin1String(metric.name))) {
+        const bool pascals = metric.id == MetricId::Pressure && name.contains("[pa]");
+        columns << Column {i, metric.storageName(), pascals ? .01 : 1.};
+      }
+    }
+  }
+  if (timeColumn < 0 || columns.isEmpty()) {
+    throw FormatError("not a Ruuvi Station export");
+  }
+
+  QString line;
+  int lineno = 1;
+  while (stream.readLineInto(&line)) {
+    lineno++;
+    if (line.isEmpty()) continue;
+
+    const auto fields = line.split(sep);
+    quint32 ts;
+    if (fields.size() <= timeColumn || !parseTime(unquoted(fields[timeColumn]), ts)) {
+      qWarning() << "line" << lineno << ": invalid time, skipping";
+      continue;
+    }
+    for (const Column& c: columns) {
+      if (c.index >= fields.size()) continue;
+      bool ok;
+      const double value = unquoted(fields[c.index]).toDouble(&ok);
+      if (!ok) continue;
+      visitor(address, c.metric, Measurement(ts, value * c.scale));
+    }
+  }
+}
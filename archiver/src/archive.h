@@ -0,0 +1,87 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./archiver/src/archive.h
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "measurementdatabase.h"
+
+#include <QDataStream>
+#include <QTextStream>
+
+class QIODevice;
+
+class FormatError {
+public:
+  FormatError(QString msg): m_detail(std::move(msg)) {}
+  const QString msg() const {return m_detail;}
+private:
+  QString m_detail;
+};
+
+using SampleVisitor = std::function<void (const QString& address, const QString& metric, const Measurement&)>;
+
+class SampleWriter {
+public:
+  virtual ~SampleWriter() = default;
+  virtual void write(const QString& address, const QString& metric, const Measurement& m) = 0;
+  virtual void finish() {}
+};
+
+// address,metric,timestamp,value
+class CsvWriter: public SampleWriter {
+public:
+  CsvWriter(QIODevice* dev);
+  void write(const QString& address, const QString& metric, const Measurement& m) override;
+  void finish() override;
+
+  static inline const QString Header = "address,metric,timestamp,value";
+
+private:
+  QTextStream m_stream;
+};
+
+// Magic and version followed by series records and chunks of at most
+// ChunkSize (timestamp, value) pairs belonging to the previous series.
+class BinaryWriter: public SampleWriter {
+public:
+  BinaryWriter(QIODevice* dev);
+  void write(const QString& address, const QString& metric, const Measurement& m) override;
+  void finish() override;
+
+  static inline const quint32 Magic = 0x4b525641; // KRVA
+  static inline const quint8 Version = 1;
+  static inline const quint8 TagEnd = 0;
+  static inline const quint8 TagSeries = 1;
+  static inline const quint8 TagChunk = 2;
+  static inline const int ChunkSize = 4096;
+
+private:
+  void flush();
+
+  QDataStream m_stream;
+  QString m_address;
+  QString m_metric;
+  MeasurementVector m_chunk;
+};
+
+// Readers stream the samples to the visitor and throw FormatError
+void readCsv(QIODevice* dev, const SampleVisitor& visitor);
+void readBinary(QIODevice* dev, const SampleVisitor& visitor);
+// Ruuvi Station exports do not contain the tag address
+void readStationCsv(QIODevice* dev, const QString& address, const SampleVisitor& visitor);
@@ -0,0 +1,106 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./archiver/src/export.cpp
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QDebug>
+#include <QFile>
+#include <memory>
+#include <limits>
+#include <cstdio>
+#include "archive.h"
+
+int main(int argc, char *argv[]) {
+  QCoreApplication app(argc, argv);
+
+  QCommandLineParser parser;
+  parser.setApplicationDescription("Export the RuuviTag measurement database");
+  parser.addOption({{"f", "format"}, "Output format: csv (default) or binary.", "format", "csv"});
+  parser.addOption({{"o", "output"}, "Write to <file> instead of the standard output.", "file"});
+  parser.addOption({"from", "Export measurements after <secs> since epoch.", "secs", "0"});
+  parser.addOption({"to", "Export measurements before <secs> since epoch.", "secs",
+                    QString::number(std::numeric_limits<quint32>::max())});
+  parser.addHelpOption();
+  parser.addPositionalArgument("ruuvitags", "Bluetooth addresses of the RuuviTag devices, all if omitted",
+                               "[ruuvitags...]");
+  parser.process(app);
+
+  const auto format = parser.value("format");
+  if (format != "csv" && format != "binary") {
+    qWarning() << "Unknown format" << format;
+    return 1;
+  }
+
+  QFile out;
+  const auto path = parser.value("output");
+  bool opened;
+  if (path.isEmpty()) {
+    opened = out.open(stdout, QIODevice::WriteOnly);
+  } else {
+    out.setFileName(path);
+    opened = out.open(QIODevice::WriteOnly | QIODevice::Truncate);
+  }
+  if (!opened) {
+    qWarning() << "Cannot open" << path;
+    return 1;
+  }
+
+  std::unique_ptr<SampleWriter> writer;
+  if (format == "csv") {
+    writer = std::make_unique<CsvWriter>(&out);
+  } else {
+    writer = std::make_unique<BinaryWriter>(&out);
+  }
+
+  const quint32 from = parser.value("from").toUInt();
+  const quint32 to = parser.value("to").toUInt();
+
+  try {
+    MeasurementDatabase db("kruuvi_export", MeasurementDatabase::Mode::ReadOnly);
+
+    auto addresses = parser.positionalArguments();
+    if (addresses.isEmpty()) {
+      addresses = db.addresses();
+    }
+
+    for (const auto& addr: addresses) {
+      const auto locId = db.locationId(addr);
+      if (locId == 0) {
+        qWarning() << addr << "not found";
+        continue;
+      }
+      for (const Metric& metric: Metrics::all) {
+        const auto name = metric.storageName();
+        db.visitMeasurements(locId, metric.id, from, to, [&] (const Measurement& m) {
+          writer->write(addr, name, m);
+        });
+      }
+    }
+  } catch (const DatabaseError& e) {
+    qWarning() << e.msg();
+    return 1;
+  } catch (const PlatformError& e) {
+    qWarning() << e.msg();
+    return 255;
+  }
+
+  writer->finish();
+
+  return 0;
+}
@@ -0,0 +1,196 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./archiver/src/import.cpp
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QDebug>
+#include <QFile>
+#include <QHash>
+#include <QtEndian>
+#include <cstdio>
+#include <algorithm>
+#include "archive.h"
+
+// Collects the samples into per series batches and inserts each batch
+// in one transaction. The database skips samples which are already stored.
+class Importer {
+public:
+
+  Importer(MeasurementDatabase& db)
+    : m_db(db) {}
+
+  void add(const QString& address, const QString& name, const Measurement& m) {
+    const Metric* metric = Metrics::fromName(name);
+    if (metric == nullptr || !metric->valid(m.value)) {
+      m_skipped++;
+      return;
+    }
+    const auto key = QString("%1/%2").arg(address).arg(name);
+    auto it = m_batches.find(key);
+    if (it == m_batches.end()) {
+      it = m_batches.insert(key, Batch {m_db.locationId(address), metric->id, MeasurementVector()});
+      it->values.reserve(BatchSize);
+    }
+    it->values << m;
+    if (it->values.size() == BatchSize) {
+      flush(*it);
+    }
+  }
+
+  void finish() {
+    for (auto& batch: m_batches) {
+      flush(batch);
+    }
+  }
+
+  int inserted() const {return m_inserted;}
+  int duplicates() const {return m_duplicates;}
+  int skipped() const {return m_skipped;}
+
+  static inline const int BatchSize = 10000;
+
+private:
+
+  struct Batch {
+    quint32 locId;
+    MetricId metric;
+    MeasurementVector values;
+  };
+
+  void flush(Batch& batch) {
+    auto& values = batch.values;
+    if (values.isEmpty()) return;
+
+    // keep the partition switches down
+    std::sort(values.begin(), values.end(), [] (const Measurement& a, const Measurement& b) {
+      return a.ts < b.ts;
+    });
+
+    const int n = m_db.insertMeasurements(batch.locId, batch.metric, values);
+    m_inserted += n;
+    m_duplicates += values.size() - n;
+    values.clear();
+  }
+
+  MeasurementDatabase& m_db;
+  QHash<QString, Batch> m_batches;
+  int m_inserted = 0;
+  int m_duplicates = 0;
+  int m_skipped = 0;
+};
+
+static QString detectFormat(QIODevice* dev) {
+  const auto head = dev->peek(1024);
+  if (head.size() >= 4 && qFromBigEndian<quint32>(head.constData()) == BinaryWriter::Magic) {
+    return "binary";
+  }
+  if (head.startsWith(CsvWriter::Header.toUtf8())) {
+    return "csv";
+  }
+  return "station";
+}
+
+int main(int argc, char *argv[]) {
+  QCoreApplication app(argc, argv);
+
+  QCommandLineParser parser;
+  parser.setApplicationDescription("Import measurements to the RuuviTag measurement database");
+  parser.addOption({{"f", "format"}, "Input format: csv, binary, station or auto (default).", "format", "auto"});
+  parser.addOption({{"a", "address"}, "Bluetooth address of the RuuviTag for Ruuvi Station exports.", "address"});
+  parser.addHelpOption();
+  parser.addPositionalArgument("files", "Files to import, - for the standard input", "files...");
+  parser.process(app);
+
+  if (parser.positionalArguments().isEmpty()) {
+    parser.showHelp(1);
+  }
+
+  try {
+    MeasurementDatabase::createTables();
+  } catch (const PlatformError& e) {
+    qWarning() << e.msg();
+    return 255;
+  }
+
+  try {
+    MeasurementDatabase db("kruuvi_import");
+    Importer importer(db);
+
+    const SampleVisitor visitor = [&importer] (const QString& address, const QString& metric,
+                                               const Measurement& m) {
+      importer.add(address, metric, m);
+    };
+
+    for (const auto& path: parser.positionalArguments()) {
+      QFile in;
+      bool opened;
+      if (path == "-") {
+        opened = in.open(stdin, QIODevice::ReadOnly);
+      } else {
+        in.setFileName(path);
+        opened = in.open(QIODevice::ReadOnly);
+      }
+      if (!opened) {
+        qWarning() << "Cannot open" << path;
+        return 1;
+      }
+
+      auto format = parser.value("format");
+      if (format == "auto") {
+        format = detectFormat(&in);
+      }
+
+      qInfo() << "Importing" << path << "as" << format;
+      if (format == "csv") {
+        readCsv(&in, visitor);
+      } else if (format == "binary") {
+        readBinary(&in, visitor);
+      } else if (format == "station") {
+        const auto address = parser.value("address");
+        if (address.isEmpty()) {
+          qWarning() << "Ruuvi Station exports need the tag address (--address)";
+          return 1;
+        }
+        readStationCsv(&in, address.toUpper(), visitor);
+      } else {
+        qWarning() << "Unknown format" << format;
+        return 1;
+      }
+    }
+
+    importer.finish();
+    db.checkpoint(true);
+
+    qInfo() << "Inserted" << importer.inserted() << "measurements,"
+            << importer.duplicates() << "duplicates and"
+            << importer.skipped() << "unknown metrics or invalid values skipped";
+
+  } catch (const FormatError& e) {
+    qWarning() << e.msg();
+    return 1;
+  } catch (const DatabaseError& e) {
+    qWarning() << e.msg();
+    return 1;
+  } catch (const PlatformError& e) {
+    qWarning() << e.msg();
+    return 255;
+  }
+
+  return 0;
+}
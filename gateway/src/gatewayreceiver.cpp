@@ -0,0 +1,268 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./gateway/src/gatewayreceiver.cpp
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "gatewayreceiver.h"
+#include "dataformat5.h"
+
+#include <QDateTime>
+#include <QDebug>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QTimer>
+#include <QSocketNotifier>
+#include <QCoreApplication>
+#include <algorithm>
+#include <cmath>
+#include <sys/socket.h>
+#include <unistd.h>
+
+GatewayReceiver::GatewayReceiver(quint32 interval, QObject* parent)
+  : QObject(parent)
+  , m_interval(interval)
+  , m_server(new QTcpServer(this))
+  , m_flushTimer(new QTimer(this)) {
+
+  if (::socketpair(AF_UNIX, SOCK_STREAM, 0, m_sigFd)) {
+    qFatal("Couldn't create a socketpair");
+  }
+  m_sig = new QSocketNotifier(m_sigFd[1], QSocketNotifier::Read, this);
+  connect(m_sig, &QSocketNotifier::activated, this, &GatewayReceiver::handleSig);
+
+  connect(m_server, &QTcpServer::newConnection, this, &GatewayReceiver::newConnection);
+
+  m_flushTimer->setInterval(FlushMSecs);
+  connect(m_flushTimer, &QTimer::timeout, this, &GatewayReceiver::flush);
+  m_flushTimer->start();
+}
+
+GatewayReceiver::~GatewayReceiver() {
+  flush();
+}
+
+bool GatewayReceiver::listen(const QHostAddress& address, quint16 port) {
+  if (!m_server->listen(address, port)) {
+    qWarning() << "Cannot listen on" << address.toString() << port << ":" << m_server->errorString();
+    return false;
+  }
+  qInfo() << "Listening on" << address.toString() << m_server->serverPort();
+  return true;
+}
+
+void GatewayReceiver::sigHandler(int sig) {
+  const int a = sig;
+  ::write(m_sigFd[0], &a, sizeof(a));
+}
+
+void GatewayReceiver::handleSig() {
+  m_sig->setEnabled(false);
+  int a;
+  ::read(m_sigFd[1], &a, sizeof(a));
+
+  qInfo() << "received sig" << a;
+  flush();
+  QCoreApplication::quit();
+}
+
+void GatewayReceiver::newConnection() {
+  while (auto socket = m_server->nextPendingConnection()) {
+    m_buffers[socket] = QByteArray();
+    connect(socket, &QTcpSocket::readyRead, this, [this, socket] () {
+      readRequests(socket);
+    });
+    connect(socket, &QTcpSocket::disconnected, this, [this, socket] () {
+      m_buffers.remove(socket);
+      socket->deleteLater();
+    });
+  }
+}
+
+// Minimal HTTP/1.x: the request line, Content-Length and Connection
+// headers, keep-alive and pipelined requests
+void GatewayReceiver::readRequests(QTcpSocket* socket) {
+  auto& buffer = m_buffers[socket];
+  buffer += socket->readAll();
+
+  while (true) {
+    const int headerEnd = buffer.indexOf("\r\n\r\n");
+    if (headerEnd < 0) {
+      if (buffer.size() > MaxHeader) {
+        respond(socket, 431, "Request Header Fields Too Large", false);
+      }
+      return;
+    }
+
+    const auto lines = buffer.left(headerEnd).split('\n');
+    const auto request = lines.first().trimmed().split(' ');
+    if (request.size() != 3) {
+      respond(socket, 400, "Bad Request", false);
+      return;
+    }
+    bool keepAlive = request[2] == "HTTP/1.1";
+    int length = 0;
+    for (int i = 1; i < lines.size(); i++) {
+      const int colon = lines[i].indexOf(':');
+      if (colon < 0) continue;
+      const auto name = lines[i].left(colon).trimmed().toLower();
+      const auto value = lines[i].mid(colon + 1).trimmed().toLower();
+      if (name == "content-length") {
+        length = value.toInt();
+      } else if (name == "connection") {
+        keepAlive = value == "keep-alive";
+      }
+    }
+    if (length < 0 || length > MaxBody) {
+      respond(socket, 413, "Payload Too Large", false);
+      return;
+    }
+
+    const int bodyStart = headerEnd + 4;
+    if (buffer.size() < bodyStart + length) return;
+
+    const auto body = buffer.mid(bodyStart, length);
+    buffer.remove(0, bodyStart + length);
+
+    if (request[0] != "POST") {
+      respond(socket, 405, "Method Not Allowed", keepAlive);
+    } else if (ingest(body)) {
+      respond(socket, 200, "OK", keepAlive);
+    } else {
+      respond(socket, 400, "Bad Request", keepAlive);
+    }
+    if (!keepAlive) return;
+  }
+}
+
+void GatewayReceiver::respond(QTcpSocket* socket, int status, const QByteArray& reason, bool keepAlive) {
+  socket->write(QString("HTTP/1.1 %1 %2\r\nContent-Length: 0\r\nConnection: %3\r\n\r\n")
+                .arg(status)
+                .arg(QString::fromLatin1(reason))
+                .arg(keepAlive ? "keep-alive" : "close")
+                .toLatin1());
+  if (!keepAlive) {
+    m_buffers[socket].clear();
+    socket->disconnectFromHost();
+  }
+}
+
+// {"data": {"timestamp": "...", "tags": {"<address>": {"timestamp": "...", "data": "<hex>"}, ...}}}
+bool GatewayReceiver::ingest(const QByteArray& body) {
+  QJsonParseError error;
+  const auto doc = QJsonDocument::fromJson(body, &error);
+  if (error.error != QJsonParseError::NoError) {
+    qWarning() << "Invalid gateway batch:" << error.errorString();
+    return false;
+  }
+  const auto data = doc.object()["data"].toObject();
+  if (!data["tags"].isObject()) {
+    qWarning() << "Invalid gateway batch: no tags";
+    return false;
+  }
+
+  // the timestamps are strings of seconds since epoch
+  const auto timestamp = [] (const QJsonValue& v, quint32 fallback) -> quint32 {
+    const quint32 ts = v.isString() ? v.toString().toUInt() : v.toVariant().toUInt();
+    return ts > 0 ? ts : fallback;
+  };
+  const quint32 sent = timestamp(data["timestamp"], QDateTime::currentSecsSinceEpoch());
+
+  const auto tags = data["tags"].toObject();
+  QStringList addresses;
+  QVector<quint32> stamps;
+  QVector<QByteArray> payloads;
+  addresses.reserve(tags.size());
+  stamps.reserve(tags.size());
+  payloads.reserve(tags.size());
+  for (auto it = tags.constBegin(); it != tags.constEnd(); ++it) {
+    const auto tag = it.value().toObject();
+    addresses << it.key().toUpper();
+    stamps << timestamp(tag["timestamp"], sent);
+    payloads << DataFormat5::manufacturerData(QByteArray::fromHex(tag["data"].toString().toLatin1()));
+  }
+
+  Readings readings;
+  if (DataFormat5::decode(payloads, readings) > 0) {
+    for (int i = 0; i < payloads.size(); i++) {
+      Reading reading;
+      for (int k = 0; k < Metrics::count; k++) {
+        reading[k] = readings[k][i];
+      }
+      add(addresses[i], stamps[i], reading);
+    }
+  }
+
+  if (m_pendingCount >= MaxPending) {
+    flush();
+  }
+  return true;
+}
+
+// All NaN readings are skipped
+void GatewayReceiver::add(const QString& address, quint32 ts, const Reading& reading) {
+  if (std::all_of(reading.cbegin(), reading.cend(), [] (float v) {return std::isnan(v);})) {
+    return;
+  }
+
+  auto it = m_locations.constFind(address);
+  if (it == m_locations.constEnd()) {
+    try {
+      MeasurementDatabase db("GatewayReceiver::location");
+      it = m_locations.insert(address, db.locationId(address));
+    } catch (const DatabaseError& e) {
+      qWarning() << "GatewayReceiver::add:" << e.msg();
+      return;
+    }
+  }
+  const auto locId = it.value();
+
+  auto accepted = m_accepted.find(locId);
+  if (accepted != m_accepted.end() && ts < accepted.value() + m_interval) {
+    return;
+  }
+  m_accepted[locId] = ts;
+
+  for (const Metric& metric: Metrics::all) {
+    const float v = reading[static_cast<int>(metric.id)];
+    if (std::isnan(v) || !metric.valid(v)) continue;
+    m_pending[static_cast<int>(metric.id)][locId] << Measurement(ts, v);
+    m_pendingCount++;
+  }
+}
+
+void GatewayReceiver::flush() {
+  if (m_pendingCount == 0) return;
+
+  try {
+    MeasurementDatabase db("GatewayReceiver::flush");
+    int inserted = 0;
+    for (const Metric& metric: Metrics::all) {
+      auto& series = m_pending[static_cast<int>(metric.id)];
+      inserted += db.insertMeasurements(metric.id, series);
+      series.clear();
+    }
+    qDebug() << "Inserted" << inserted << "of" << m_pendingCount << "measurements";
+  } catch (const DatabaseError& e) {
+    qWarning() << "GatewayReceiver::flush:" << e.msg();
+    for (auto& series: m_pending) {
+      series.clear();
+    }
+  }
+  m_pendingCount = 0;
+}
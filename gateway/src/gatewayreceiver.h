@@ -0,0 +1,88 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./gateway/src/gatewayreceiver.h
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <QObject>
+#include <QHash>
+#include <QHostAddress>
+#include <array>
+#include "measurementdatabase.h"
+#include "dataformat5.h"
+
+class QTcpServer;
+class QTcpSocket;
+class QTimer;
+class QSocketNotifier;
+
+// Receives the advertisements which Ruuvi Gateways POST as JSON over
+// HTTP and stores the Data Format 5 values. The gateway batches are
+// parsed as they arrive, the measurements are inserted every
+// FlushMSecs in one transaction per metric. At most one measurement
+// per tag and interval is stored, 0 stores all.
+class GatewayReceiver: public QObject {
+
+  Q_OBJECT
+
+public:
+
+  GatewayReceiver(quint32 interval, QObject* parent = nullptr);
+  ~GatewayReceiver();
+
+  bool listen(const QHostAddress& address, quint16 port);
+
+  // Flushes the pending measurements and quits
+  static void sigHandler(int sig);
+
+public slots:
+
+  void flush();
+
+private slots:
+
+  void handleSig();
+
+private:
+
+  void newConnection();
+  void readRequests(QTcpSocket* socket);
+  void respond(QTcpSocket* socket, int status, const QByteArray& reason, bool keepAlive);
+  // Returns false if the body is not a gateway batch
+  bool ingest(const QByteArray& body);
+  void add(const QString& address, quint32 ts, const Reading& reading);
+
+  static inline const int FlushMSecs = 10000;
+  static inline const int MaxPending = 20000;
+  static inline const int MaxHeader = 8 * 1024;
+  static inline const int MaxBody = 4 * 1024 * 1024;
+
+  static inline int m_sigFd[2] = {0, 0};
+
+  const quint32 m_interval;
+  QSocketNotifier* m_sig;
+  QTcpServer* m_server;
+  QTimer* m_flushTimer;
+  QHash<QTcpSocket*, QByteArray> m_buffers;
+  // Location ids never change
+  QHash<QString, quint32> m_locations;
+  // Timestamp of the last accepted advertisement by location
+  QHash<quint32, quint32> m_accepted;
+  std::array<SeriesMap, Metrics::count> m_pending;
+  int m_pendingCount = 0;
+};
@@ -0,0 +1,77 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./gateway/src/main.cpp
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QDebug>
+#include <signal.h>
+#include "gatewayreceiver.h"
+
+static int setup_unix_signal_handlers() {
+
+  const int sigs[3] = {SIGHUP, SIGTERM, SIGINT};
+  for (int i = 0; i < 3; ++i) {
+    struct sigaction a;
+    a.sa_handler = GatewayReceiver::sigHandler;
+    sigemptyset(&a.sa_mask);
+    a.sa_flags = 0;
+    a.sa_flags |= SA_RESTART;
+    if (sigaction(sigs[i], &a, 0) != 0) return sigs[i];
+  }
+
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  QCoreApplication app(argc, argv);
+
+  QCommandLineParser parser;
+  parser.setApplicationDescription("Store the RuuviTag advertisements posted by Ruuvi Gateways to a database");
+  parser.addOption({"listen", "Listen on <address>, 0.0.0.0 for all interfaces.", "address", "127.0.0.1"});
+  parser.addOption({{"p", "port"}, "Listen on <port>.", "port", "8280"});
+  parser.addOption({"interval", "Store at most one measurement per tag in <secs>, 0 stores all.",
+                    "secs", "300"});
+  parser.addHelpOption();
+  parser.process(app);
+
+  const QHostAddress address(parser.value("listen"));
+  if (address.isNull()) {
+    qWarning() << "Invalid address" << parser.value("listen");
+    return 1;
+  }
+
+  auto ret = setup_unix_signal_handlers();
+  if (ret > 0) {
+    return ret;
+  }
+
+  try {
+    MeasurementDatabase::createTables();
+  } catch (const PlatformError& e) {
+    qWarning() << e.msg();
+    return 255;
+  }
+
+  GatewayReceiver receiver(parser.value("interval").toUInt());
+  if (!receiver.listen(address, parser.value("port").toUShort())) {
+    return 1;
+  }
+
+  return app.exec();
+}
@@ -0,0 +1,265 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./historyd/src/historyserver.cpp
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "historyserver.h"
+#include "historyclient.h"
+#include "resample.h"
+#include "changenotifier.h"
+
+#include <QDataStream>
+#include <QDebug>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <algorithm>
+#include <limits>
+
+HistoryServer::HistoryServer(QObject* parent)
+  : QObject(parent)
+  , m_server(new QLocalServer(this))
+  , m_stats(new StatsIndex("HistoryServer::stats"))
+  , m_resampled(MaxCacheCost) {
+  m_server->setSocketOptions(QLocalServer::UserAccessOption);
+  connect(m_server, &QLocalServer::newConnection, this, &HistoryServer::newConnection);
+
+  auto listener = new ChangeListener(this);
+  connect(listener, &ChangeListener::changed, this, &HistoryServer::invalidate);
+}
+
+HistoryServer::~HistoryServer() {
+  delete m_stats;
+}
+
+bool HistoryServer::listen() {
+  const auto path = History::socketPath();
+
+  QLocalSocket probe;
+  probe.connectToServer(path);
+  if (probe.waitForConnected(HistoryClient::ConnectMSecs)) {
+    qWarning() << "Another history server is listening on" << path;
+    return false;
+  }
+  // stale socket of a killed server
+  QLocalServer::removeServer(path);
+
+  if (!m_server->listen(path)) {
+    qWarning() << "Cannot listen on" << path << ":" << m_server->errorString();
+    return false;
+  }
+  qInfo() << "Listening on" << path;
+  return true;
+}
+
+void HistoryServer::newConnection() {
+  while (auto socket = m_server->nextPendingConnection()) {
+    m_buffers[socket] = QByteArray();
+    connect(socket, &QLocalSocket::readyRead, this, [this, socket] () {
+      readRequests(socket);
+    });
+    connect(socket, &QLocalSocket::disconnected, this, [this, socket] () {
+      m_buffers.remove(socket);
+      socket->deleteLater();
+    });
+  }
+}
+
+void HistoryServer::readRequests(QLocalSocket* socket) {
+  auto& buffer = m_buffers[socket];
+  buffer += socket->readAll();
+
+  QByteArray request;
+  while (History::takeFrame(buffer, request)) {
+    socket->write(History::frame(handle(request)));
+  }
+
+  if (buffer.size() > static_cast<int>(History::MaxRequest + sizeof(quint32))) {
+    qWarning() << "Oversized request, closing the connection";
+    socket->abort();
+  }
+}
+
+QByteArray HistoryServer::handle(const QByteArray& request) {
+  QDataStream in(request);
+  History::setup(in);
+
+  quint8 version = 0;
+  quint8 op = 0;
+  in >> version >> op;
+
+  QByteArray reply;
+  QDataStream out(&reply, QIODevice::WriteOnly);
+  History::setup(out);
+
+  try {
+    if (version != History::Version) {
+      throw DatabaseError(QString("unsupported protocol version %1").arg(version));
+    }
+    switch (static_cast<History::Op>(op)) {
+    case History::Op::Range:
+      range(in, out);
+      break;
+    case History::Op::Resample: {
+      if (const auto cached = m_resampled.object(request)) {
+        return cached->reply;
+      }
+      const auto addrs = resample(in, out);
+      m_resampled.insert(request, new Cached {addrs, reply}, reply.size());
+      break;
+    }
+    case History::Op::Stats:
+      stats(in, out);
+      break;
+    default:
+      throw DatabaseError(QString("unknown request %1").arg(op));
+    }
+  } catch (const DatabaseError& e) {
+    return errorReply(e.msg());
+  } catch (const PlatformError& e) {
+    // e.g. no database path, the client reads the database itself
+    return errorReply(e.msg());
+  }
+
+  return reply;
+}
+
+QByteArray HistoryServer::errorReply(const QString& msg) {
+  QByteArray error;
+  QDataStream err(&error, QIODevice::WriteOnly);
+  History::setup(err);
+  err << static_cast<quint8>(History::Status::Error) << msg;
+  return error;
+}
+
+// Reads the common arguments and throws on malformed requests
+static void readWindow(QDataStream& in, quint8& metric, quint32& start, quint32& end) {
+  in >> metric >> start >> end;
+  if (in.status() != QDataStream::Ok || metric >= Metrics::count || end < start) {
+    throw DatabaseError("malformed request");
+  }
+}
+
+void HistoryServer::range(QDataStream& in, QDataStream& out) {
+  QStringList addrs;
+  quint8 metric;
+  quint32 start;
+  quint32 end;
+  in >> addrs;
+  readWindow(in, metric, start, end);
+
+  const auto ids = locationIds(addrs);
+  MeasurementDatabase db("HistoryServer::range", MeasurementDatabase::Mode::ReadOnly);
+  const auto values = db.measurements(ids, static_cast<MetricId>(metric), start, end);
+
+  out << static_cast<quint8>(History::Status::Ok) << static_cast<quint32>(addrs.size());
+  for (int i = 0; i < addrs.size(); i++) {
+    const auto series = values.value(ids[i]);
+    out << addrs[i] << static_cast<quint32>(series.size());
+    for (const Measurement& m: series) {
+      out << m.ts << m.value;
+    }
+  }
+}
+
+QStringList HistoryServer::resample(QDataStream& in, QDataStream& out) {
+  QStringList addrs;
+  quint8 metric;
+  quint32 start;
+  quint32 end;
+  quint16 samples;
+  quint32 maxGap;
+  in >> addrs;
+  readWindow(in, metric, start, end);
+  in >> samples >> maxGap;
+  if (in.status() != QDataStream::Ok) {
+    throw DatabaseError("malformed request");
+  }
+
+  const auto ids = locationIds(addrs);
+  MeasurementDatabase db("HistoryServer::resample", MeasurementDatabase::Mode::ReadOnly);
+  const auto values = db.measurements(ids, static_cast<MetricId>(metric),
+                                      start - std::min(start, Margin), end + Margin);
+
+  out << static_cast<quint8>(History::Status::Ok) << static_cast<quint32>(addrs.size());
+  for (int i = 0; i < addrs.size(); i++) {
+    out << addrs[i] << samples;
+    for (const double v: ::resample(values.value(ids[i]), start, end, samples, maxGap)) {
+      out << static_cast<float>(v);
+    }
+  }
+  return addrs;
+}
+
+void HistoryServer::stats(QDataStream& in, QDataStream& out) {
+  QString addr;
+  quint8 metric;
+  quint32 start;
+  quint32 end;
+  quint8 n;
+  in >> addr;
+  readWindow(in, metric, start, end);
+  in >> n;
+  QVector<double> ps;
+  for (quint8 i = 0; i < n && in.status() == QDataStream::Ok; i++) {
+    double p;
+    in >> p;
+    ps << p;
+  }
+  if (in.status() != QDataStream::Ok) {
+    throw DatabaseError("malformed request");
+  }
+
+  const auto locId = locationIds({addr}).first();
+  const auto id = static_cast<MetricId>(metric);
+  Stats s;
+  if (locId != 0) {
+    s = m_stats->stats(locId, id, start, end);
+  }
+
+  out << static_cast<quint8>(History::Status::Ok) << s.count << s.min << s.max << s.mean << n;
+  for (const double p: ps) {
+    out << (locId != 0 ? m_stats->percentile(locId, id, start, end, p) : std::numeric_limits<float>::quiet_NaN());
+  }
+}
+
+void HistoryServer::invalidate(const QString& addr, const QString& metric, quint32 from, quint32 to) {
+  m_stats->invalidate(addr, metric, from, to);
+  for (const auto& key: m_resampled.keys()) {
+    if (m_resampled.object(key)->addrs.contains(addr)) {
+      m_resampled.remove(key);
+    }
+  }
+}
+
+// Unknown addresses map to 0, which has no measurements
+QVector<quint32> HistoryServer::locationIds(const QStringList& addrs) {
+  QVector<quint32> ids;
+  MeasurementDatabase db("HistoryServer::location", MeasurementDatabase::Mode::ReadOnly);
+  for (const auto& addr: addrs) {
+    auto it = m_locations.constFind(addr);
+    if (it == m_locations.constEnd()) {
+      const auto locId = db.locationId(addr);
+      if (locId == 0) {
+        ids << 0;
+        continue;
+      }
+      it = m_locations.insert(addr, locId);
+    }
+    ids << it.value();
+  }
+  return ids;
+}
@@ -0,0 +1,77 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./historyd/src/historyserver.h
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <QObject>
+#include <QCache>
+#include <QHash>
+#include <QStringList>
+
+class QDataStream;
+class QLocalServer;
+class QLocalSocket;
+class StatsIndex;
+
+// Answers the history queries of the local clients from one shared
+// cache. Resampled series are cached by request until the measurements
+// of one of their tags change, the stats index stays warm between the
+// queries of all clients.
+class HistoryServer: public QObject {
+
+  Q_OBJECT
+
+public:
+
+  HistoryServer(QObject* parent = nullptr);
+  ~HistoryServer();
+
+  // False if the socket cannot be created or another server is running
+  bool listen();
+
+private:
+
+  void newConnection();
+  void readRequests(QLocalSocket* socket);
+  QByteArray handle(const QByteArray& request);
+  static QByteArray errorReply(const QString& msg);
+  void range(QDataStream& in, QDataStream& out);
+  // Returns the addresses of the reply for the cache
+  QStringList resample(QDataStream& in, QDataStream& out);
+  void stats(QDataStream& in, QDataStream& out);
+  void invalidate(const QString& addr, const QString& metric, quint32 from, quint32 to);
+  QVector<quint32> locationIds(const QStringList& addrs);
+
+  // extra data around the window for the interpolation
+  static inline const quint32 Margin = 3600;
+  // bytes of cached replies
+  static inline const int MaxCacheCost = 16 * 1024 * 1024;
+
+  struct Cached {
+    QStringList addrs;
+    QByteArray reply;
+  };
+
+  QLocalServer* m_server;
+  StatsIndex* const m_stats;
+  // Location ids never change, unknown addresses are not cached
+  QHash<QString, quint32> m_locations;
+  QCache<QByteArray, Cached> m_resampled;
+  QHash<QLocalSocket*, QByteArray> m_buffers;
+};
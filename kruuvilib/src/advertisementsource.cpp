@@ -0,0 +1,222 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./kruuvilib/src/advertisementsource.cpp
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "advertisementsource.h"
+#include "dataformat5.h"
+#include "sqlitedatabase.h"
+
+#include <QDateTime>
+#include <QFile>
+#include <QTextStream>
+#include <QTimer>
+#include <QtEndian>
+
+// HCI event packet without the H4 type byte. Collects the Ruuvi
+// advertisements of LE (extended) advertising reports.
+static void parseEvent(const uchar* p, int size, qint64 msecs, QVector<Advertisement>& ads) {
+  if (size < 4 || p[0] != 0x3e) return; // LE meta event
+  const uchar sub = p[2];
+  const int reports = p[3];
+  int i = 4;
+
+  const auto address = [] (const uchar* a) {
+    // little endian
+    return QString("%1:%2:%3:%4:%5:%6")
+        .arg(a[5], 2, 16, QChar('0')).arg(a[4], 2, 16, QChar('0')).arg(a[3], 2, 16, QChar('0'))
+        .arg(a[2], 2, 16, QChar('0')).arg(a[1], 2, 16, QChar('0')).arg(a[0], 2, 16, QChar('0'))
+        .toUpper();
+  };
+  const auto add = [&ads, msecs] (const QString& addr, const uchar* data, int len) {
+    const auto payload = DataFormat5::manufacturerData(QByteArray(reinterpret_cast<const char*>(data), len));
+    if (!payload.isEmpty()) {
+      ads << Advertisement {addr, msecs, payload};
+    }
+  };
+
+  for (int r = 0; r < reports; r++) {
+    if (sub == 0x02) {
+      // event type, address type, address, length, data, rssi
+      if (i + 9 > size) return;
+      const int len = p[i + 8];
+      if (i + 9 + len + 1 > size) return;
+      add(address(p + i + 2), p + i + 9, len);
+      i += 9 + len + 1;
+    } else if (sub == 0x0d) {
+      // event type (2), address type, address, phys (2), sid, tx power, rssi,
+      // interval (2), direct address type, direct address, length, data
+      if (i + 24 > size) return;
+      const int len = p[i + 23];
+      if (i + 24 + len > size) return;
+      add(address(p + i + 3), p + i + 24, len);
+      i += 24 + len;
+    } else {
+      return;
+    }
+  }
+}
+
+// btsnoop timestamps are microseconds since year 0
+static const qint64 BtsnoopEpochDelta = 0x00dcddb30f2f8000LL;
+
+static void readBtsnoop(const QByteArray& bytes, QVector<Advertisement>& ads) {
+  const auto p = reinterpret_cast<const uchar*>(bytes.constData());
+  const int size = bytes.size();
+  const quint32 datalink = qFromBigEndian<quint32>(p + 12);
+  // HCI, H4 and the btmon monitor format
+  if (datalink != 1001 && datalink != 1002 && datalink != 2001) {
+    throw PlatformError(QString("unsupported btsnoop datalink %1").arg(datalink));
+  }
+
+  for (int i = 16; i + 24 <= size;) {
+    const quint32 len = qFromBigEndian<quint32>(p + i + 4);
+    const quint32 flags = qFromBigEndian<quint32>(p + i + 8);
+    const qint64 usecs = qFromBigEndian<qint64>(p + i + 16);
+    i += 24;
+    if (len > static_cast<quint32>(size - i)) break;
+    const qint64 msecs = (usecs - BtsnoopEpochDelta) / 1000;
+    if (datalink == 1002) {
+      if (len > 0 && p[i] == 0x04) parseEvent(p + i + 1, len - 1, msecs, ads);
+    } else if (datalink == 2001) {
+      // opcode in the low bits, 3 is an event
+      if ((flags & 0xffff) == 3) parseEvent(p + i, len, msecs, ads);
+    } else if ((flags & 3) == 3) {
+      // received event
+      parseEvent(p + i, len, msecs, ads);
+    }
+    i += len;
+  }
+}
+
+static void readPcap(const QByteArray& bytes, QVector<Advertisement>& ads) {
+  const auto p = reinterpret_cast<const uchar*>(bytes.constData());
+  const int size = bytes.size();
+  if (size < 24) return;
+
+  const quint32 magic = qFromLittleEndian<quint32>(p);
+  const bool little = magic == 0xa1b2c3d4 || magic == 0xa1b23c4d;
+  const bool nanos = magic == 0xa1b23c4d || magic == 0x4d3cb2a1;
+  const auto u32 = [little] (const uchar* q) {
+    return little ? qFromLittleEndian<quint32>(q) : qFromBigEndian<quint32>(q);
+  };
+
+  // H4, H4 with a direction pseudo header
+  const quint32 linktype = u32(p + 20);
+  if (linktype != 187 && linktype != 201) {
+    throw PlatformError(QString("unsupported pcap link type %1").arg(linktype));
+  }
+  const int skip = linktype == 201 ? 4 : 0;
+
+  for (int i = 24; i + 16 <= size;) {
+    const qint64 secs = u32(p + i);
+    const qint64 fraction = u32(p + i + 4);
+    const quint32 len = u32(p + i + 8);
+    i += 16;
+    if (len > static_cast<quint32>(size - i)) break;
+    const qint64 msecs = secs * 1000 + fraction / (nanos ? 1000000 : 1000);
+    if (len > static_cast<quint32>(skip) + 1 && p[i + skip] == 0x04) {
+      parseEvent(p + i + skip + 1, len - skip - 1, msecs, ads);
+    }
+    i += len;
+  }
+}
+
+static void readText(QFile* file, QVector<Advertisement>& ads) {
+  QTextStream stream(file);
+  QString line;
+  while (stream.readLineInto(&line)) {
+    if (line.isEmpty() || line.startsWith('#')) continue;
+    const auto fields = line.splitRef(' ', Qt::SkipEmptyParts);
+    if (fields.size() != 3) continue;
+    bool ok;
+    const qint64 msecs = fields[0].toLongLong(&ok);
+    if (!ok) continue;
+    ads << Advertisement {fields[1].toString().toUpper(), msecs, QByteArray::fromHex(fields[2].toLatin1())};
+  }
+}
+
+ReplaySource::ReplaySource(const QString& fileName, Speed speed, QObject* parent)
+  : AdvertisementSource(parent)
+  , m_speed(speed)
+  , m_timer(new QTimer(this)) {
+
+  QFile file(fileName);
+  if (!file.open(QIODevice::ReadOnly)) {
+    throw PlatformError(QString("Cannot open %1").arg(fileName));
+  }
+
+  const auto head = file.peek(24);
+  if (head.startsWith(QByteArray("btsnoop\0", 8))) {
+    readBtsnoop(file.readAll(), m_ads);
+  } else if (head.size() == 24 && (qFromLittleEndian<quint32>(head.constData()) & 0xffff0000) == 0xa1b20000) {
+    readPcap(file.readAll(), m_ads);
+  } else if (head.size() == 24 && (qFromBigEndian<quint32>(head.constData()) & 0xffff0000) == 0xa1b20000) {
+    readPcap(file.readAll(), m_ads);
+  } else {
+    readText(&file, m_ads);
+  }
+
+  m_timer->setSingleShot(true);
+  connect(m_timer, &QTimer::timeout, this, &ReplaySource::emitNext);
+}
+
+const QVector<Advertisement>& ReplaySource::advertisements() const {
+  return m_ads;
+}
+
+void ReplaySource::write(const QVector<Advertisement>& ads, QIODevice* dev) {
+  QTextStream stream(dev);
+  for (const Advertisement& ad: ads) {
+    stream << ad.msecs << ' ' << ad.address << ' ' << ad.data.toHex() << '\n';
+  }
+}
+
+void ReplaySource::start() {
+  m_next = 0;
+  m_started = QDateTime::currentMSecsSinceEpoch();
+  m_timer->start(0);
+}
+
+void ReplaySource::stop() {
+  m_timer->stop();
+}
+
+void ReplaySource::emitNext() {
+  if (m_speed == Speed::Maximum) {
+    const int last = std::min(m_next + BatchSize, m_ads.size());
+    for (; m_next < last; m_next++) {
+      emit received(m_ads[m_next]);
+    }
+  } else {
+    const qint64 elapsed = QDateTime::currentMSecsSinceEpoch() - m_started;
+    const qint64 first = m_ads.isEmpty() ? 0 : m_ads.first().msecs;
+    for (; m_next < m_ads.size() && m_ads[m_next].msecs - first <= elapsed; m_next++) {
+      emit received(m_ads[m_next]);
+    }
+    if (m_next < m_ads.size()) {
+      m_timer->start(std::max<qint64>(0, m_ads[m_next].msecs - first - elapsed));
+      return;
+    }
+  }
+
+  if (m_next < m_ads.size()) {
+    m_timer->start(0);
+  } else {
+    emit finished();
+  }
+}
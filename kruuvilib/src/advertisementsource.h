@@ -0,0 +1,86 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./kruuvilib/src/advertisementsource.h
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <QObject>
+#include <QVector>
+
+class QTimer;
+
+struct Advertisement {
+  QString address;
+  qint64 msecs; // since epoch
+  QByteArray data; // Ruuvi manufacturer data without the company id
+};
+
+Q_DECLARE_METATYPE(Advertisement)
+
+// Delivers RuuviTag advertisements from somewhere
+class AdvertisementSource: public QObject {
+
+  Q_OBJECT
+
+public:
+
+  using QObject::QObject;
+
+  virtual void start() = 0;
+  virtual void stop() = 0;
+
+signals:
+
+  void received(const Advertisement& ad);
+  void finished();
+};
+
+// Replays recorded advertisements, either at the recorded pace or as fast
+// as the receivers keep up. Reads btsnoop and pcap (H4 link types)
+// captures of the HCI traffic, using the LE advertising reports, or text
+// lines of "<msecs since epoch> <address> <hex manufacturer data>".
+// Throws PlatformError if the file cannot be read.
+class ReplaySource: public AdvertisementSource {
+
+  Q_OBJECT
+
+public:
+
+  enum class Speed {RealTime, Maximum};
+
+  ReplaySource(const QString& fileName, Speed speed, QObject* parent = nullptr);
+
+  void start() override;
+  void stop() override;
+
+  const QVector<Advertisement>& advertisements() const;
+  static void write(const QVector<Advertisement>& ads, QIODevice* dev);
+
+  // advertisements per event loop round at maximum speed
+  static inline const int BatchSize = 1024;
+
+private:
+
+  void emitNext();
+
+  const Speed m_speed;
+  QVector<Advertisement> m_ads;
+  int m_next = 0;
+  qint64 m_started = 0;
+  QTimer* m_timer;
+};
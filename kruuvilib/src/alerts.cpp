@@ -0,0 +1,260 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./kruuvilib/src/alerts.cpp
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "alerts.h"
+
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QStandardPaths>
+#include <QDBusConnection>
+#include <QDBusMessage>
+#include <algorithm>
+#include <cmath>
+
+static const QHash<QString, RuleType> ruleTypes {
+  {"above", RuleType::Above},
+  {"below", RuleType::Below},
+  {"rate", RuleType::Rate},
+  {"stale", RuleType::Stale},
+};
+
+QString AlertRule::fileName() {
+  const auto loc = QStandardPaths::writableLocation(QStandardPaths::GenericConfigLocation);
+  return QString("%1/%2/alerts.json").arg(loc).arg(PROJECT_NAME);
+}
+
+QVector<AlertRule> AlertRule::load() {
+  QVector<AlertRule> rules;
+
+  QFile file(fileName());
+  if (!file.exists()) return rules;
+  if (!file.open(QIODevice::ReadOnly)) {
+    qWarning() << "Cannot read" << file.fileName();
+    return rules;
+  }
+
+  QJsonParseError error;
+  const auto doc = QJsonDocument::fromJson(file.readAll(), &error);
+  if (!doc.isArray()) {
+    qWarning() << file.fileName() << ":" << error.errorString();
+    return rules;
+  }
+
+  for (const auto v: doc.array()) {
+    const auto obj = v.toObject();
+    const auto name = obj["name"].toString();
+    const auto type = obj["type"].toString();
+    const Metric* metric = Metrics::fromName(obj["metric"].toString("temperature"));
+    // the state is kept by name
+    const bool duplicate = std::any_of(rules.cbegin(), rules.cend(), [&name] (const AlertRule& r) {
+      return r.name == name;
+    });
+    if (name.isEmpty() || duplicate || !ruleTypes.contains(type) || metric == nullptr ||
+        !obj["limit"].isDouble()) {
+      qWarning() << file.fileName() << ": skipping invalid rule" << name;
+      continue;
+    }
+    rules << AlertRule {name, obj["address"].toString().toUpper(), metric->id, ruleTypes[type],
+                        obj["limit"].toDouble(), static_cast<quint32>(obj["window"].toInt(3600))};
+    if (rules.last().window == 0) {
+      rules.last().window = 3600;
+    }
+  }
+
+  return rules;
+}
+
+
+QString AlertEvent::message() const {
+  const Metric& m = Metrics::get(metric);
+  if (!raised) {
+    return QString("%1: %2 back to normal").arg(rule).arg(address);
+  }
+  switch (type) {
+  case RuleType::Above:
+  case RuleType::Below:
+    return QString("%1: %2 %3 %4 %5").arg(rule).arg(address).arg(m.name).arg(value, 0, 'f', 1).arg(m.unit);
+  case RuleType::Rate:
+    return QString("%1: %2 %3 changing %4 %5").arg(rule).arg(address).arg(m.name).arg(value, 0, 'f', 1).arg(m.unit);
+  case RuleType::Stale:
+    return QString("%1: %2 not heard for %3 minutes").arg(rule).arg(address).arg(qRound(value / 60));
+  }
+  return rule;
+}
+
+void AlertEvent::notify() const {
+  auto bus = QDBusConnection::sessionBus();
+  if (!bus.isConnected()) return;
+
+  auto msg = QDBusMessage::createMethodCall("org.freedesktop.Notifications",
+                                            "/org/freedesktop/Notifications",
+                                            "org.freedesktop.Notifications",
+                                            "Notify");
+  msg << QString(PROJECT_NAME) << quint32(0) << QString("ruuvitag") << QString("RuuviTag")
+      << message() << QStringList() << QVariantMap() << qint32(-1);
+  bus.call(msg, QDBus::NoBlock);
+}
+
+
+AlertEngine::AlertEngine(QVector<AlertRule> rules)
+  : m_rules(std::move(rules)) {}
+
+QString AlertEngine::key(const AlertRule& rule, const QString& address) {
+  return QString("%1/%2").arg(rule.name).arg(address);
+}
+
+void AlertEngine::update(const AlertRule& rule, const QString& address, State& state,
+                         bool condition, quint32 ts, double value, AlertEvents& events) {
+  if (condition != state.active) {
+    state.active = condition;
+    events << AlertEvent {ts, address, rule.name, rule.metric, rule.type, value, condition};
+  }
+  state.dirty = true;
+}
+
+AlertEvents AlertEngine::evaluate(const QString& address, MetricId metric, const MeasurementVector& samples) {
+  AlertEvents events;
+  if (samples.isEmpty()) return events;
+
+  for (const AlertRule& rule: m_rules) {
+    if (!rule.matches(address)) continue;
+
+    State& state = m_states[key(rule, address)];
+
+    if (rule.type == RuleType::Stale) {
+      // heard again
+      if (state.active) {
+        update(rule, address, state, false, samples.last().ts, 0, events);
+      }
+      continue;
+    }
+
+    if (rule.metric != metric) continue;
+
+    for (const Measurement& m: samples) {
+      if (m.ts <= state.ts || std::isnan(m.value)) continue;
+
+      switch (rule.type) {
+      case RuleType::Above:
+        update(rule, address, state, m.value > rule.limit, m.ts, m.value, events);
+        state.ts = m.ts;
+        break;
+      case RuleType::Below:
+        update(rule, address, state, m.value < rule.limit, m.ts, m.value, events);
+        state.ts = m.ts;
+        break;
+      case RuleType::Rate:
+        // state holds the sample which starts the window
+        if (state.ts == 0) {
+          state.ts = m.ts;
+          state.value = m.value;
+          state.dirty = true;
+        } else if (m.ts - state.ts >= rule.window) {
+          const double change = (m.value - state.value) * rule.window / (m.ts - state.ts);
+          update(rule, address, state, std::abs(change) > rule.limit, m.ts, change, events);
+          state.ts = m.ts;
+          state.value = m.value;
+        }
+        break;
+      case RuleType::Stale:
+        break;
+      }
+    }
+  }
+
+  return events;
+}
+
+AlertEvents AlertEngine::checkStale(const QString& address, quint32 lastSeen, quint32 now) {
+  AlertEvents events;
+  if (lastSeen == 0) return events;
+
+  for (const AlertRule& rule: m_rules) {
+    if (rule.type != RuleType::Stale || !rule.matches(address)) continue;
+
+    State& state = m_states[key(rule, address)];
+    const quint32 silence = now > lastSeen ? now - lastSeen : 0;
+    const bool condition = silence > rule.limit;
+    if (condition != state.active) {
+      update(rule, address, state, condition, now, silence, events);
+    }
+  }
+
+  return events;
+}
+
+void AlertEngine::loadState(SQLiteDatabase& db, const QString& address) {
+  auto r0 = db.prepare("select rule, active, timestamp, value from alert_state where address = ?");
+  r0.bindValue(0, address);
+  db.exec(r0);
+
+  while (r0.next()) {
+    State& state = m_states[QString("%1/%2").arg(r0.value(0).toString()).arg(address)];
+    state.active = r0.value(1).toBool();
+    state.ts = r0.value(2).toUInt();
+    state.value = r0.value(3).toFloat();
+    state.dirty = false;
+  }
+}
+
+void AlertEngine::save(SQLiteDatabase& db, const AlertEvents& events) {
+  if (!db.transaction()) {
+    qWarning() << "Transactions not supported";
+  }
+
+  try {
+    for (auto it = m_states.begin(); it != m_states.end(); ++it) {
+      State& state = it.value();
+      if (!state.dirty) continue;
+      const auto sep = it.key().lastIndexOf('/');
+      auto r0 = db.prepare("insert or replace into alert_state (rule, address, active, timestamp, value) "
+                           "values (?, ?, ?, ?, ?)");
+      r0.bindValue(0, it.key().left(sep));
+      r0.bindValue(1, it.key().mid(sep + 1));
+      r0.bindValue(2, state.active);
+      r0.bindValue(3, state.ts);
+      r0.bindValue(4, state.value);
+      db.exec(r0);
+      state.dirty = false;
+    }
+
+    for (const AlertEvent& e: events) {
+      auto r1 = db.prepare("insert into alert_event (timestamp, address, rule, name, value, raised) "
+                           "values (?, ?, ?, ?, ?, ?)");
+      r1.bindValue(0, e.ts);
+      r1.bindValue(1, e.address);
+      r1.bindValue(2, e.rule);
+      r1.bindValue(3, Metrics::get(e.metric).storageName());
+      r1.bindValue(4, e.value);
+      r1.bindValue(5, e.raised);
+      db.exec(r1);
+    }
+  } catch (const DatabaseError&) {
+    db.rollback();
+    throw;
+  }
+
+  if (!db.commit()) {
+    qWarning() << "Transactions/Commits not supported";
+  }
+}
@@ -0,0 +1,108 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./kruuvilib/src/alerts.h
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "measurementdatabase.h"
+
+#include <QHash>
+
+enum class RuleType: quint8 {Above, Below, Rate, Stale};
+
+// A condition on the measurements of one tag, or of all tags when the
+// address is empty. Above and Below compare each sample to the limit,
+// Rate compares the change between consecutive samples scaled to window
+// seconds and Stale holds when nothing has been heard for limit seconds.
+// The rules are read from alerts.json in the kruuvi config directory:
+//
+// [{"name": "freezer", "address": "D2:3D:...", "metric": "temperature",
+//   "type": "above", "limit": -15},
+//  {"name": "storm", "metric": "pressure", "type": "rate", "limit": 2, "window": 3600}]
+struct AlertRule {
+  QString name;
+  QString address;
+  MetricId metric;
+  RuleType type;
+  double limit;
+  quint32 window;
+
+  bool matches(const QString& addr) const {return address.isEmpty() || address == addr;}
+
+  static QString fileName();
+  // Invalid rules are skipped with a warning
+  static QVector<AlertRule> load();
+};
+
+// raised is false when the condition stops holding
+struct AlertEvent {
+  quint32 ts;
+  QString address;
+  QString rule;
+  MetricId metric;
+  RuleType type;
+  // the sample, the scaled change or the silence in seconds
+  double value;
+  bool raised;
+
+  QString message() const;
+  // Desktop notification, nothing happens without a session bus
+  void notify() const;
+};
+
+using AlertEvents = QVector<AlertEvent>;
+
+// Evaluates the rules on the new samples only. The state kept per rule
+// and tag is whether the condition holds and the last sample seen, so an
+// event is produced when a condition starts or stops holding and
+// history is never read back. kruuvi_readlog keeps the state in the
+// alert_state table and writes the events to the alert_event table. The
+// dataengine starts from the stored state and only notifies the desktop,
+// so a condition which still holds is not announced again after a
+// restart and each crossing is announced once.
+class AlertEngine {
+public:
+
+  AlertEngine(QVector<AlertRule> rules = AlertRule::load());
+
+  bool isEmpty() const {return m_rules.isEmpty();}
+
+  // The samples are in timestamp order, the ones already seen are skipped
+  AlertEvents evaluate(const QString& address, MetricId metric, const MeasurementVector& samples);
+  AlertEvents checkStale(const QString& address, quint32 lastSeen, quint32 now);
+
+  void loadState(SQLiteDatabase& db, const QString& address);
+  // Writes the changed state and the events
+  void save(SQLiteDatabase& db, const AlertEvents& events);
+
+private:
+
+  struct State {
+    bool active = false;
+    bool dirty = false;
+    quint32 ts = 0;
+    float value = 0;
+  };
+
+  static QString key(const AlertRule& rule, const QString& address);
+  void update(const AlertRule& rule, const QString& address, State& state,
+              bool condition, quint32 ts, double value, AlertEvents& events);
+
+  QVector<AlertRule> m_rules;
+  QHash<QString, State> m_states;
+};
@@ -0,0 +1,120 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./kruuvilib/src/changenotifier.cpp
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "changenotifier.h"
+
+#include <QDebug>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QFileSystemWatcher>
+#include <QStandardPaths>
+
+QString ChangeNotifier::fileName() {
+  QString loc = QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation);
+  loc = QString("%1/%2").arg(loc).arg(PROJECT_NAME);
+  QDir().mkpath(loc);
+  return QString("%1/changes.log").arg(loc);
+}
+
+void ChangeNotifier::publish(const QString& address, MetricId metric, quint32 from, quint32 to) {
+  QFile file(fileName());
+  const bool restart = !file.exists() || file.size() > MaxSize;
+  auto mode = QIODevice::WriteOnly | QIODevice::Append;
+  if (restart) {
+    mode = QIODevice::WriteOnly | QIODevice::Truncate;
+  }
+  if (!file.open(mode)) {
+    qWarning() << "Cannot write" << file.fileName();
+    return;
+  }
+  QString line;
+  if (restart) {
+    // A new generation tells the listeners to start from the beginning
+    line = QString("# %1\n").arg(QDateTime::currentMSecsSinceEpoch());
+  }
+  line += QString("%1 %2 %3 %4\n").arg(address).arg(Metrics::get(metric).name).arg(from).arg(to);
+  // one write per record keeps the appends atomic
+  file.write(line.toUtf8());
+}
+
+QByteArray ChangeNotifier::generation(const QByteArray& head) {
+  const int eol = head.indexOf('\n');
+  if (!head.startsWith('#') || eol < 0) return QByteArray();
+  return head.left(eol);
+}
+
+
+ChangeListener::ChangeListener(QObject* parent)
+  : QObject(parent)
+  , m_watcher(new QFileSystemWatcher(this))
+  , m_fileName(ChangeNotifier::fileName()) {
+
+  // only the changes after this point are interesting
+  QFile file(m_fileName);
+  if (file.open(QIODevice::ReadOnly)) {
+    m_offset = file.size();
+    m_generation = ChangeNotifier::generation(file.readLine());
+  }
+
+  m_watcher->addPath(QFileInfo(m_fileName).absolutePath());
+  watch();
+
+  connect(m_watcher, &QFileSystemWatcher::directoryChanged, this, [this] () {
+    watch();
+    readChanges();
+  });
+  connect(m_watcher, &QFileSystemWatcher::fileChanged, this, [this] () {
+    watch();
+    readChanges();
+  });
+}
+
+void ChangeListener::watch() {
+  if (!m_watcher->files().contains(m_fileName) && QFile::exists(m_fileName)) {
+    m_watcher->addPath(m_fileName);
+  }
+}
+
+void ChangeListener::readChanges() {
+  QFile file(m_fileName);
+  if (!file.open(QIODevice::ReadOnly)) return;
+
+  // The file is small, one read sees a consistent generation
+  const auto bytes = file.readAll();
+  const auto generation = ChangeNotifier::generation(bytes);
+  if (generation != m_generation || bytes.size() < m_offset) {
+    // truncated by a writer, possibly already longer than before
+    m_generation = generation;
+    m_offset = generation.size() > 0 ? generation.size() + 1 : 0;
+  }
+
+  // a record still being written is read on the next change
+  const int end = bytes.lastIndexOf('\n') + 1;
+  if (end <= m_offset) return;
+  const auto lines = bytes.mid(m_offset, end - m_offset).split('\n');
+  m_offset = end;
+
+  for (const auto& line: lines) {
+    const auto fields = QString::fromUtf8(line).split(' ');
+    if (fields.size() != 4) continue;
+    emit changed(fields[0], fields[1], fields[2].toUInt(), fields[3].toUInt());
+  }
+}
@@ -0,0 +1,65 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./kruuvilib/src/changenotifier.h
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <QObject>
+#include "metrics.h"
+
+class QFileSystemWatcher;
+
+// Committed changes are appended to a change log file as lines of
+// "address metric from to". The writers may run without a session bus
+// (e.g. from cron), the log works regardless. The file is truncated
+// when it grows beyond MaxSize and then starts with a "# <msecs>"
+// generation line, which the listeners compare to notice the truncation.
+class ChangeNotifier {
+public:
+
+  static void publish(const QString& address, MetricId metric, quint32 from, quint32 to);
+  static QString fileName();
+  // The generation line at the head of the file, empty if there is none
+  static QByteArray generation(const QByteArray& head);
+
+  static inline const qint64 MaxSize = 64 * 1024;
+};
+
+// Watches the change log and emits changed for each appended record
+class ChangeListener: public QObject {
+
+  Q_OBJECT
+
+public:
+
+  ChangeListener(QObject* parent = nullptr);
+
+signals:
+
+  void changed(const QString& address, const QString& metric, quint32 from, quint32 to);
+
+private:
+
+  void watch();
+  void readChanges();
+
+  QFileSystemWatcher* m_watcher;
+  const QString m_fileName;
+  qint64 m_offset = 0;
+  QByteArray m_generation;
+};
@@ -0,0 +1,90 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./kruuvilib/src/connectionmanager.cpp
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "connectionmanager.h"
+
+#include <QDebug>
+#include <QtSql/QSqlDatabase>
+#include <QThreadStorage>
+#include <QCoreApplication>
+#include <QAtomicInt>
+
+namespace {
+
+struct ThreadConnections {
+
+  ThreadConnections(int n)
+    : suffix(QString::number(n)) {}
+
+  ~ThreadConnections() {
+    // At exit the connections go away with the process
+    if (QCoreApplication::instance() == nullptr) return;
+    release();
+  }
+
+  void release() {
+    for (auto it = statements.begin(); it != statements.end(); ++it) {
+      it.value()->clear();
+      {
+        auto db = QSqlDatabase::database(it.key(), false);
+        db.close();
+      }
+      QSqlDatabase::removeDatabase(it.key());
+    }
+    statements.clear();
+    states.clear();
+  }
+
+  const QString suffix;
+  QHash<QString, ConnectionManager::StatementCachePtr> statements;
+  QHash<QString, std::shared_ptr<void>> states;
+};
+
+QThreadStorage<ThreadConnections*> connections;
+QAtomicInt threadCount;
+
+ThreadConnections* local() {
+  if (!connections.hasLocalData()) {
+    connections.setLocalData(new ThreadConnections(threadCount.fetchAndAddRelaxed(1)));
+  }
+  return connections.localData();
+}
+
+}
+
+QString ConnectionManager::connectionName(const QString& purpose) {
+  return QString("%1@%2").arg(purpose).arg(local()->suffix);
+}
+
+ConnectionManager::StatementCachePtr ConnectionManager::statements(const QString& connName) {
+  auto& cache = local()->statements[connName];
+  if (!cache) {
+    cache = std::make_shared<StatementCache>(MaxStatements);
+  }
+  return cache;
+}
+
+std::shared_ptr<void>& ConnectionManager::stateSlot(const QString& connName) {
+  return local()->states[connName];
+}
+
+void ConnectionManager::releaseThread() {
+  if (!connections.hasLocalData()) return;
+  connections.localData()->release();
+}
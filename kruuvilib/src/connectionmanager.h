@@ -0,0 +1,61 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./kruuvilib/src/connectionmanager.h
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <QtSql/QSqlQuery>
+#include <QHash>
+#include <QCache>
+#include <memory>
+
+// QtSql connections can only be used in the thread which created them.
+// The manager turns a purpose like "DBReader::fetch" into a connection
+// name unique to the calling thread and keeps the prepared statements of
+// the thread's connections and the schema caches of the database classes
+// using them. The connections are closed and removed when the thread
+// finishes.
+class ConnectionManager {
+public:
+
+  // Least recently used statements are dropped beyond MaxStatements, the
+  // SQL text includes partition names and IN (...) arities
+  using StatementCache = QCache<QString, QSqlQuery>;
+  using StatementCachePtr = std::shared_ptr<StatementCache>;
+
+  static QString connectionName(const QString& purpose);
+  // Statement cache of a connection of the calling thread
+  static StatementCachePtr statements(const QString& connName);
+  static inline const int MaxStatements = 128;
+  // State kept per connection of the calling thread, created on first use.
+  // There is one slot per connection, a purpose belongs to one class.
+  template<typename T>
+  static std::shared_ptr<T> state(const QString& connName) {
+    auto& slot = stateSlot(connName);
+    if (!slot) {
+      slot = std::make_shared<T>();
+    }
+    return std::static_pointer_cast<T>(slot);
+  }
+  // Closes and removes the connections of the calling thread now
+  static void releaseThread();
+
+private:
+
+  static std::shared_ptr<void>& stateSlot(const QString& connName);
+};
@@ -0,0 +1,87 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./kruuvilib/src/dataformat5.cpp
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "dataformat5.h"
+
+#include <QtEndian>
+#include <limits>
+
+QByteArray DataFormat5::manufacturerData(const QByteArray& advertisement) {
+  const auto* p = reinterpret_cast<const quint8*>(advertisement.constData());
+  const int size = advertisement.size();
+  // length, type, data
+  for (int i = 0; i + 1 < size && p[i] != 0; i += p[i] + 1) {
+    const int len = p[i];
+    if (i + len >= size) break;
+    if (p[i + 1] != 0xff || len < 3) continue;
+    const quint16 company = p[i + 2] | (p[i + 3] << 8);
+    if (company == ManufacturerId) {
+      return advertisement.mid(i + 4, len - 3);
+    }
+  }
+  return QByteArray();
+}
+
+static_assert(Metrics::count == 3, "Data Format 5 carries all the metrics");
+
+static constexpr float nan = std::numeric_limits<float>::quiet_NaN();
+
+// Big endian fields after the format byte, no length checks
+static inline void decodeFields(const char* p, float& t, float& h, float& pr) {
+  const auto ti = qFromBigEndian<qint16>(p + 1);
+  const auto hi = qFromBigEndian<quint16>(p + 3);
+  const auto pi = qFromBigEndian<quint16>(p + 5);
+  t = ti == -0x8000 ? nan : ti * .005f;
+  h = hi == 0xffff ? nan : hi * .0025f;
+  pr = pi == 0xffff ? nan : (pi + 50000) * .01f;
+}
+
+static inline bool valid(const QByteArray& payload) {
+  return payload.size() >= DataFormat5::MinSize && static_cast<quint8>(payload[0]) == DataFormat5::Format;
+}
+
+bool DataFormat5::decode(const QByteArray& payload, Reading& reading) {
+  if (!valid(payload)) return false;
+  decodeFields(payload.constData(),
+               reading[static_cast<int>(MetricId::Temperature)],
+               reading[static_cast<int>(MetricId::Humidity)],
+               reading[static_cast<int>(MetricId::Pressure)]);
+  return true;
+}
+
+int DataFormat5::decode(const QVector<QByteArray>& payloads, Readings& readings) {
+  const int base = readings[0].size();
+  for (auto& values: readings) {
+    values.resize(base + payloads.size());
+  }
+  float* t = readings[static_cast<int>(MetricId::Temperature)].data() + base;
+  float* h = readings[static_cast<int>(MetricId::Humidity)].data() + base;
+  float* p = readings[static_cast<int>(MetricId::Pressure)].data() + base;
+
+  int count = 0;
+  for (int i = 0; i < payloads.size(); i++) {
+    if (valid(payloads[i])) {
+      decodeFields(payloads[i].constData(), t[i], h[i], p[i]);
+      count++;
+    } else {
+      t[i] = h[i] = p[i] = nan;
+    }
+  }
+  return count;
+}
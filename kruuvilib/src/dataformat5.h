@@ -0,0 +1,51 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./kruuvilib/src/dataformat5.h
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "metrics.h"
+
+#include <QByteArray>
+#include <QVector>
+
+// Values indexed by MetricId
+using Reading = std::array<float, Metrics::count>;
+// Value arrays indexed by MetricId
+using Readings = std::array<QVector<float>, Metrics::count>;
+
+// RuuviTag advertisements in Data Format 5 (RAWv2)
+namespace DataFormat5 {
+
+inline const quint16 ManufacturerId = 1177;
+inline const quint8 Format = 5;
+// format, temperature, humidity and pressure
+inline const int MinSize = 7;
+
+// The Ruuvi manufacturer data of raw advertisement data (AD structures)
+// without the company id, empty if there is none
+QByteArray manufacturerData(const QByteArray& advertisement);
+// The payload starts with the format byte. Values which the tag reports
+// unavailable are NaN.
+bool decode(const QByteArray& payload, Reading& reading);
+// Appends the values of the payloads to the arrays, which stay aligned
+// with the payloads: invalid payloads are all NaN. Returns the number of
+// valid payloads.
+int decode(const QVector<QByteArray>& payloads, Readings& readings);
+
+}
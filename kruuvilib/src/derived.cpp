@@ -0,0 +1,82 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./kruuvilib/src/derived.cpp
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "derived.h"
+#include "resample.h"
+
+#include <cmath>
+
+// Magnus formula, Sonntag 1990 coefficients over water
+static constexpr double MagnusB = 17.62;
+static constexpr double MagnusC = 243.12;
+static constexpr double MagnusE0 = 6.112; // hPa
+// water vapour: M / R in g K / J
+static constexpr double VapourFactor = 100 * 18.01528 / 8.314462618;
+
+void dewPoint(const double* t, const double* rh, double* out, int n) {
+  for (int i = 0; i < n; i++) {
+    const double g = std::log(rh[i] / 100) + MagnusB * t[i] / (MagnusC + t[i]);
+    out[i] = MagnusC * g / (MagnusB - g);
+  }
+}
+
+void absoluteHumidity(const double* t, const double* rh, double* out, int n) {
+  for (int i = 0; i < n; i++) {
+    const double e = MagnusE0 * std::exp(MagnusB * t[i] / (MagnusC + t[i])) * rh[i] / 100;
+    out[i] = VapourFactor * e / (273.15 + t[i]);
+  }
+}
+
+void difference(const double* a, const double* b, double* out, int n) {
+  for (int i = 0; i < n; i++) {
+    out[i] = a[i] - b[i];
+  }
+}
+
+QVector<double> derive(DerivedId id, const MetricSeries& inputs, quint32 start, quint32 end,
+                       int samples, quint32 maxGap) {
+  const auto& metric = DerivedMetrics::get(id);
+  const auto input = [&] (MetricId m, quint32 shift) {
+    return resample(inputs[static_cast<int>(m)], start - shift, end - shift, samples, maxGap);
+  };
+
+  QVector<double> out(samples);
+  switch (id) {
+  case DerivedId::DewPoint: {
+    const auto t = input(MetricId::Temperature, 0);
+    const auto h = input(MetricId::Humidity, 0);
+    dewPoint(t.constData(), h.constData(), out.data(), samples);
+    break;
+  }
+  case DerivedId::AbsoluteHumidity: {
+    const auto t = input(MetricId::Temperature, 0);
+    const auto h = input(MetricId::Humidity, 0);
+    absoluteHumidity(t.constData(), h.constData(), out.data(), samples);
+    break;
+  }
+  case DerivedId::PressureTendency: {
+    // the same grid shifted back by the lookback
+    const auto p = input(MetricId::Pressure, 0);
+    const auto p0 = input(MetricId::Pressure, metric.lookback);
+    difference(p.constData(), p0.constData(), out.data(), samples);
+    break;
+  }
+  }
+  return out;
+}
@@ -0,0 +1,73 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./kruuvilib/src/derived.h
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "measurementdatabase.h"
+
+#include <array>
+
+enum class DerivedId: quint8 {DewPoint, AbsoluteHumidity, PressureTendency};
+
+// A quantity computed from the measured metrics. The inputs are needed
+// from lookback seconds before the window.
+struct DerivedMetric {
+  DerivedId id;
+  const char* name;
+  const char* unit;
+  std::array<bool, Metrics::count> inputs;
+  quint32 lookback;
+
+  QString storageName() const {return QString::fromLatin1(name);}
+};
+
+namespace DerivedMetrics {
+
+// Indexed by DerivedId
+inline const std::array<DerivedMetric, 3> all = {{
+  {DerivedId::DewPoint, "dewpoint", "°C", {true, true, false}, 0},
+  {DerivedId::AbsoluteHumidity, "absolutehumidity", "g/m³", {true, true, false}, 0},
+  {DerivedId::PressureTendency, "pressuretendency", "hPa/3h", {false, false, true}, 3 * 3600},
+}};
+
+inline const DerivedMetric& get(DerivedId id) {
+  return all[static_cast<int>(id)];
+}
+
+inline const DerivedMetric* fromName(const QString& name) {
+  for (const DerivedMetric& m: all) {
+    if (name == QLatin1String(m.name)) return &m;
+  }
+  return nullptr;
+}
+
+}
+
+// Measurements indexed by MetricId
+using MetricSeries = std::array<MeasurementVector, Metrics::count>;
+
+// Single pass kernels over aligned arrays, NaN propagates
+void dewPoint(const double* t, const double* rh, double* out, int n);
+void absoluteHumidity(const double* t, const double* rh, double* out, int n);
+void difference(const double* a, const double* b, double* out, int n);
+
+// The derived series on the resample() grid. The inputs cover the window
+// and the lookback before it.
+QVector<double> derive(DerivedId id, const MetricSeries& inputs, quint32 start, quint32 end,
+                       int samples, quint32 maxGap);
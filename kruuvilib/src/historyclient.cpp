@@ -0,0 +1,211 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./kruuvilib/src/historyclient.cpp
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "historyclient.h"
+
+#include <QDataStream>
+#include <QDateTime>
+#include <QDeadlineTimer>
+#include <QLocalSocket>
+#include <QStandardPaths>
+#include <QtEndian>
+#include <algorithm>
+
+QString History::socketPath() {
+  QString loc = QStandardPaths::writableLocation(QStandardPaths::RuntimeLocation);
+  return QString("%1/%2-history").arg(loc).arg(PROJECT_NAME);
+}
+
+void History::setup(QDataStream& stream) {
+  stream.setVersion(QDataStream::Qt_5_15);
+  stream.setByteOrder(QDataStream::BigEndian);
+  stream.setFloatingPointPrecision(QDataStream::SinglePrecision);
+}
+
+QByteArray History::frame(const QByteArray& payload) {
+  QByteArray r(sizeof(quint32), '\0');
+  qToBigEndian<quint32>(payload.size(), r.data());
+  r += payload;
+  return r;
+}
+
+bool History::takeFrame(QByteArray& buffer, QByteArray& payload) {
+  if (buffer.size() < static_cast<int>(sizeof(quint32))) return false;
+  const quint32 size = qFromBigEndian<quint32>(buffer.constData());
+  if (static_cast<quint32>(buffer.size()) - sizeof(quint32) < size) return false;
+  payload = buffer.mid(sizeof(quint32), size);
+  buffer.remove(0, sizeof(quint32) + size);
+  return true;
+}
+
+static void checkStatus(QDataStream& in) {
+  quint8 status;
+  in >> status;
+  if (static_cast<History::Status>(status) == History::Status::Error) {
+    QString msg;
+    in >> msg;
+    throw DatabaseError(msg);
+  }
+}
+
+
+HistoryClient::HistoryClient()
+  : m_socket(new QLocalSocket) {}
+
+HistoryClient::~HistoryClient() {
+  delete m_socket;
+}
+
+bool HistoryClient::available() {
+  if (m_socket->state() == QLocalSocket::ConnectedState) return true;
+
+  const auto now = QDateTime::currentSecsSinceEpoch();
+  if (now < m_retryAt) return false;
+
+  m_socket->connectToServer(History::socketPath());
+  if (m_socket->waitForConnected(ConnectMSecs)) return true;
+
+  m_socket->abort();
+  m_retryAt = now + RetrySecs;
+  return false;
+}
+
+AddressSeries HistoryClient::range(const QStringList& addrs, MetricId metric, quint32 start, quint32 end) {
+  QByteArray payload;
+  QDataStream out(&payload, QIODevice::WriteOnly);
+  History::setup(out);
+  out << History::Version << static_cast<quint8>(History::Op::Range)
+      << addrs << static_cast<quint8>(metric) << start << end;
+
+  const auto reply = request(payload);
+  QDataStream in(reply);
+  History::setup(in);
+  checkStatus(in);
+
+  AddressSeries results;
+  quint32 n;
+  in >> n;
+  for (quint32 i = 0; i < n && in.status() == QDataStream::Ok; i++) {
+    QString addr;
+    quint32 m;
+    in >> addr >> m;
+    auto& values = results[addr];
+    values.reserve(std::min(m, static_cast<quint32>(reply.size())));
+    for (quint32 j = 0; j < m && in.status() == QDataStream::Ok; j++) {
+      quint32 ts;
+      float value;
+      in >> ts >> value;
+      values << Measurement(ts, value);
+    }
+  }
+  if (in.status() != QDataStream::Ok) {
+    fail("truncated range reply");
+  }
+  return results;
+}
+
+AddressSamples HistoryClient::resample(const QStringList& addrs, MetricId metric, quint32 start, quint32 end,
+                                       quint16 samples, quint32 maxGap) {
+  QByteArray payload;
+  QDataStream out(&payload, QIODevice::WriteOnly);
+  History::setup(out);
+  out << History::Version << static_cast<quint8>(History::Op::Resample)
+      << addrs << static_cast<quint8>(metric) << start << end << samples << maxGap;
+
+  const auto reply = request(payload);
+  QDataStream in(reply);
+  History::setup(in);
+  checkStatus(in);
+
+  AddressSamples results;
+  quint32 n;
+  in >> n;
+  for (quint32 i = 0; i < n && in.status() == QDataStream::Ok; i++) {
+    QString addr;
+    quint16 m;
+    in >> addr >> m;
+    auto& values = results[addr];
+    values.reserve(m);
+    for (quint16 j = 0; j < m && in.status() == QDataStream::Ok; j++) {
+      float value;
+      in >> value;
+      values << value;
+    }
+  }
+  if (in.status() != QDataStream::Ok) {
+    fail("truncated resample reply");
+  }
+  return results;
+}
+
+Stats HistoryClient::stats(const QString& addr, MetricId metric, quint32 start, quint32 end,
+                           const QVector<double>& ps, QVector<float>& percentiles) {
+  QByteArray payload;
+  QDataStream out(&payload, QIODevice::WriteOnly);
+  History::setup(out);
+  out << History::Version << static_cast<quint8>(History::Op::Stats)
+      << addr << static_cast<quint8>(metric) << start << end << static_cast<quint8>(ps.size());
+  for (const double p: ps) {
+    out << p;
+  }
+
+  const auto reply = request(payload);
+  QDataStream in(reply);
+  History::setup(in);
+  checkStatus(in);
+
+  Stats s;
+  quint8 n;
+  in >> s.count >> s.min >> s.max >> s.mean >> n;
+  percentiles.clear();
+  for (quint8 i = 0; i < n && in.status() == QDataStream::Ok; i++) {
+    float value;
+    in >> value;
+    percentiles << value;
+  }
+  if (in.status() != QDataStream::Ok) {
+    fail("truncated stats reply");
+  }
+  return s;
+}
+
+QByteArray HistoryClient::request(const QByteArray& payload) {
+  const QDeadlineTimer deadline(ReplyMSecs);
+  m_socket->write(History::frame(payload));
+  if (!m_socket->waitForBytesWritten(deadline.remainingTime())) {
+    fail(QString("cannot send request: %1").arg(m_socket->errorString()));
+  }
+
+  QByteArray buffer;
+  QByteArray reply;
+  while (true) {
+    buffer += m_socket->readAll();
+    if (History::takeFrame(buffer, reply)) break;
+    if (deadline.hasExpired() || !m_socket->waitForReadyRead(deadline.remainingTime())) {
+      fail(QString("no reply: %1").arg(m_socket->errorString()));
+    }
+  }
+  return reply;
+}
+
+void HistoryClient::fail(const QString& msg) {
+  m_socket->abort();
+  m_retryAt = QDateTime::currentSecsSinceEpoch() + RetrySecs;
+  throw PlatformError(msg);
+}
@@ -0,0 +1,97 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./kruuvilib/src/historyclient.h
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "statsindex.h"
+
+#include <QHash>
+
+class QDataStream;
+class QLocalSocket;
+
+// Wire format of the history service. Frames are a big endian quint32
+// payload size followed by the payload, written with QDataStream
+// (Qt 5.15, big endian, single precision, so doubles go as floats).
+//
+// Request: Version, Op and the arguments
+//   Range:    QStringList addresses, quint8 metric, quint32 start, quint32 end
+//   Resample: QStringList addresses, quint8 metric, quint32 start, quint32 end,
+//             quint16 samples, quint32 maxGap
+//   Stats:    QString address, quint8 metric, quint32 start, quint32 end,
+//             quint8 n, n x float percentile in [0, 1]
+// Reply: Status, then QString message on error, otherwise
+//   Range:    quint32 n, n x (QString address, quint32 m, m x (quint32 ts, float value))
+//   Resample: quint32 n, n x (QString address, quint16 m, m x float)
+//   Stats:    quint32 count, float min, float max, float mean, quint8 n, n x float
+namespace History {
+
+enum class Op: quint8 {Range = 1, Resample, Stats};
+enum class Status: quint8 {Ok, Error};
+
+inline const quint8 Version = 1;
+// Requests are small, larger frames close the connection
+inline const quint32 MaxRequest = 64 * 1024;
+
+QString socketPath();
+void setup(QDataStream& stream);
+QByteArray frame(const QByteArray& payload);
+// Moves the first complete frame of the buffer to payload
+bool takeFrame(QByteArray& buffer, QByteArray& payload);
+
+}
+
+using AddressSeries = QHash<QString, MeasurementVector>;
+using AddressSamples = QHash<QString, QVector<double>>;
+
+// Synchronous client of kruuvi_historyd. Throws PlatformError when the
+// service cannot be reached or does not reply within ReplyMSecs and
+// DatabaseError when the query fails there. The client runs in the GUI
+// thread, so the waits are short and the callers fall back to reading
+// the database themselves.
+class HistoryClient {
+public:
+
+  HistoryClient();
+  ~HistoryClient();
+
+  // Connects if needed. After a failure the service is retried only
+  // after RetrySecs, so that callers can fall back cheaply.
+  bool available();
+
+  AddressSeries range(const QStringList& addrs, MetricId metric, quint32 start, quint32 end);
+  AddressSamples resample(const QStringList& addrs, MetricId metric, quint32 start, quint32 end,
+                          quint16 samples, quint32 maxGap);
+  // The percentiles for ps are stored in percentiles
+  Stats stats(const QString& addr, MetricId metric, quint32 start, quint32 end,
+              const QVector<double>& ps, QVector<float>& percentiles);
+
+  static inline const int ConnectMSecs = 100;
+  // for the whole request
+  static inline const int ReplyMSecs = 300;
+  static inline const qint64 RetrySecs = 60;
+
+private:
+
+  QByteArray request(const QByteArray& payload);
+  void fail(const QString& msg);
+
+  QLocalSocket* m_socket;
+  qint64 m_retryAt = 0;
+};
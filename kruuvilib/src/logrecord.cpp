@@ -0,0 +1,90 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./kruuvilib/src/logrecord.cpp
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "logrecord.h"
+
+#include <QtEndian>
+#include <algorithm>
+
+static void decodeRecords(const QByteArray& packet, LogRecord::Series& series, LogRecord::Result& r) {
+  const char* p = packet.constData();
+  const char* const end = p + packet.size() - packet.size() % LogRecord::Size;
+  for (; p != end; p += LogRecord::Size) {
+    const auto dst = static_cast<quint8>(p[0]);
+    const auto src = static_cast<quint8>(p[1]);
+    const auto op = static_cast<quint8>(p[2]);
+    if (dst != LogRecord::Environmental || op != LogRecord::OpResponse) continue;
+
+    const auto ts = qFromBigEndian<quint32>(p + 3);
+    if (src == LogRecord::Environmental && ts == LogRecord::End) {
+      r.end = true;
+      continue;
+    }
+
+    const Metric* metric = Metrics::fromSource(src);
+    if (metric == nullptr) {
+      r.unsupported++;
+      continue;
+    }
+    const float value = metric->scale * qFromBigEndian<qint32>(p + 7);
+    if (!metric->valid(value)) {
+      r.discarded++;
+      continue;
+    }
+    series[static_cast<int>(metric->id)] << Measurement(ts, value);
+    r.measurements++;
+  }
+}
+
+LogRecord::Result LogRecord::decode(const QByteArray& packet, Series& series) {
+  Result r;
+  decodeRecords(packet, series, r);
+  return r;
+}
+
+LogRecord::Result LogRecord::decode(const QVector<QByteArray>& packets, Series& series) {
+  int records = 0;
+  for (const auto& packet: packets) {
+    records += packet.size() / Size;
+  }
+  // most records carry a measurement, keep the growth geometric
+  for (auto& values: series) {
+    const int needed = values.size() + records / Metrics::count + 1;
+    if (values.capacity() < needed) {
+      values.reserve(std::max(needed, 2 * values.capacity()));
+    }
+  }
+
+  Result r;
+  for (const auto& packet: packets) {
+    decodeRecords(packet, series, r);
+  }
+  return r;
+}
+
+QByteArray LogRecord::request(quint32 from, quint32 now) {
+  QByteArray bytes(Size, '\0');
+  char* p = bytes.data();
+  p[0] = Environmental;
+  p[1] = Environmental;
+  p[2] = OpRequest;
+  qToBigEndian<quint32>(now, p + 3);
+  qToBigEndian<quint32>(from, p + 7);
+  return bytes;
+}
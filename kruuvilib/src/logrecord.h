@@ -0,0 +1,56 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./kruuvilib/src/logrecord.h
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "measurementdatabase.h"
+
+#include <array>
+
+// Records of the RuuviTag log read over the Nordic UART service:
+// destination, source, operation, big endian timestamp and value. A
+// notification may carry several records.
+namespace LogRecord {
+
+inline const int Size = 11;
+inline const quint8 Environmental = 0x3a;
+inline const quint8 OpRequest = 0x11;
+inline const quint8 OpResponse = 0x10;
+// timestamp of the record which ends the log
+inline const quint32 End = 0xffffffff;
+
+// Indexed by MetricId
+using Series = std::array<MeasurementVector, Metrics::count>;
+
+struct Result {
+  int measurements = 0;
+  int discarded = 0;   // values outside the metric range
+  int unsupported = 0; // unknown sources
+  bool end = false;
+};
+
+// Appends the measurements of the whole records in the packets to series
+Result decode(const QByteArray& packet, Series& series);
+Result decode(const QVector<QByteArray>& packets, Series& series);
+// Asks for the log after from. The tag converts its clock to record
+// timestamps with now, which must be the current time: the tag always
+// sends everything up to its present.
+QByteArray request(quint32 from, quint32 now);
+
+}
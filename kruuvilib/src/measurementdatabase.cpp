@@ -18,53 +18,242 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "measurementdatabase.h"
+#include "changenotifier.h"
 
 #include <QDebug>
 #include <QDateTime>
 #include <QSqlError>
+#include <algorithm>
+#include <limits>
 
 
 void MeasurementDatabase::createTables() {
+  const auto connName = ConnectionManager::connectionName("MeasurementDatabase::createTables");
   {
-    auto db = QSqlDatabase::addDatabase("QSQLITE", "MeasurementDatabase::createTables");
+    auto db = QSqlDatabase::addDatabase("QSQLITE", connName);
 
     db.setDatabaseName(databaseName("measurements"));
     db.open();
     auto query = QSqlQuery(db);
 
+    // Let the retention policy give the deleted pages back to the filesystem.
+    // Existing databases need a one time vacuum for the setting to take effect.
+    query.exec("pragma auto_vacuum");
+    if (query.first() && query.value(0).toInt() != IncrementalVacuum) {
+      query.exec(QString("pragma auto_vacuum=%1").arg(IncrementalVacuum));
+      query.exec("vacuum");
+    }
+
+    // Readers do not block on the ingest transaction in WAL mode
+    query.exec("pragma journal_mode=WAL");
+
     query.exec("create table if not exists location ("
                "id integer primary key autoincrement, "
                "address text unique)");
 
-    query.exec("create table if not exists temperature ("
-               "id integer primary key autoincrement, "
+    query.exec("create table if not exists sync_state ("
                "location_id integer not null, "
+               "name text not null, "
                "timestamp integer not null, "
-               "value real not null)");
+               "primary key (location_id, name))");
 
-    query.exec("create table if not exists pressure ("
-               "id integer primary key autoincrement, "
+    query.exec("create table if not exists retention ("
                "location_id integer not null, "
-               "timestamp integer not null, "
-               "value real not null)");
+               "name text not null, "
+               "aggregated integer not null, "
+               "primary key (location_id, name))");
 
-    query.exec("create table if not exists humidity ("
-               "id integer primary key autoincrement, "
+    // Bumped on every change of the month, see dataVersion
+    query.exec("create table if not exists data_version ("
                "location_id integer not null, "
+               "month integer not null, "
+               "version integer not null, "
+               "primary key (location_id, month))");
+
+    // See AlertEngine
+    query.exec("create table if not exists alert_state ("
+               "rule text not null, "
+               "address text not null, "
+               "active integer not null, "
+               "timestamp integer not null, "
+               "value real, "
+               "primary key (rule, address))");
+
+    query.exec("create table if not exists alert_event ("
+               "id integer primary key, "
                "timestamp integer not null, "
-               "value real not null)");
+               "address text not null, "
+               "rule text not null, "
+               "name text not null, "
+               "value real, "
+               "raised integer not null)");
 
     db.close();
   }
-  QSqlDatabase::removeDatabase("MeasurementDatabase::createTables");
+  QSqlDatabase::removeDatabase(connName);
+
+  MeasurementDatabase db("MeasurementDatabase::migrate");
+  db.migrate();
 }
 
-MeasurementDatabase::MeasurementDatabase(const QString& connName)
-  : SQLiteDatabase(connName)
+void MeasurementDatabase::migrate() {
+  auto r0 = exec("pragma user_version");
+  const int version = r0.first() ? r0.value(0).toInt() : 0;
+  if (version >= SchemaVersion) return;
+
+  qInfo() << "Migrating measurement database from version" << version << "to" << SchemaVersion;
+
+  if (!transaction()) {
+    qWarning() << "Transactions not supported";
+  }
+
+  try {
+    if (version < 1) {
+      // Move the single per metric tables to monthly partitions
+      const auto existing = m_DB.tables();
+      for (const Metric& metric: Metrics::all) {
+        const auto table = metric.storageName();
+        if (!existing.contains(table)) continue;
+
+        auto r1 = exec(QString("select min(timestamp), max(timestamp) from %1").arg(table));
+        if (r1.first() && !r1.value(0).isNull()) {
+          const int first = monthKey(r1.value(0).toUInt());
+          const int last = monthKey(r1.value(1).toUInt());
+          for (int key = first; key <= last; key++) {
+            const auto name = ensurePartition(metric.id, key).name;
+            auto r2 = prepare(QString("insert or ignore into %1 (location_id, timestamp, value) "
+                                      "select location_id, timestamp, value from %2 "
+                                      "where timestamp >= ? and timestamp < ? order by id")
+                              .arg(name).arg(table));
+            r2.bindValue(0, monthStart(key));
+            r2.bindValue(1, monthStart(key + 1));
+            exec(r2);
+          }
+        }
+        exec(QString("drop table %1").arg(table));
+      }
+    }
+
+    if (version < 2) {
+      // Remove duplicate measurements, keeping the first one, and enforce uniqueness
+      for (const Metric& metric: Metrics::all) {
+        for (const auto& part: partitions(metric.id)) {
+          const auto& name = part.name;
+          exec(QString("delete from %1 where id not in "
+                       "(select min(id) from %1 group by location_id, timestamp)").arg(name));
+          exec(QString("drop index if exists %1_location_timestamp").arg(name));
+          exec(QString("create unique index %1_location_timestamp on %1 (location_id, timestamp)")
+               .arg(name));
+        }
+      }
+    }
+
+    if (version < 3) {
+      // Seed the sync watermarks from the stored measurements
+      for (const Metric& metric: Metrics::all) {
+        for (const auto& part: partitions(metric.id)) {
+          auto r1 = prepare(QString("insert into sync_state (location_id, name, timestamp) "
+                                    "select location_id, ?, max(timestamp) from %1 where true group by location_id "
+                                    "on conflict (location_id, name) do update set "
+                                    "timestamp = max(timestamp, excluded.timestamp)").arg(part.name));
+          r1.bindValue(0, metric.storageName());
+          exec(r1);
+        }
+      }
+    }
+
+    exec(QString("pragma user_version=%1").arg(SchemaVersion));
+  } catch (const DatabaseError&) {
+    rollback();
+    throw;
+  }
+
+  if (!commit()) {
+    qWarning() << "Transactions/Commits not supported";
+  }
+}
+
+MeasurementDatabase::MeasurementDatabase(const QString& purpose, Mode mode)
+  : SQLiteDatabase(purpose, mode)
+  , m_Partitions(ConnectionManager::state<PartitionCache>(m_DB.connectionName()))
 {
-  m_DB.setDatabaseName(databaseName("measurements"));
-  m_DB.open();
-  m_Query = QSqlQuery(m_DB);
+  open(databaseName("measurements"));
+}
+
+int MeasurementDatabase::monthKey(quint32 ts) {
+  const auto date = QDateTime::fromSecsSinceEpoch(ts, Qt::UTC).date();
+  return date.year() * 12 + date.month() - 1;
+}
+
+quint32 MeasurementDatabase::monthStart(int key) {
+  const QDate date(key / 12, key % 12 + 1, 1);
+  return QDateTime(date, QTime(0, 0), Qt::UTC).toSecsSinceEpoch();
+}
+
+MeasurementDatabase::Partition MeasurementDatabase::partition(const Metric& metric, int key) {
+  Partition part;
+  part.name = QString("%1_%2%3").arg(metric.storageName()).arg(key / 12).arg(key % 12 + 1, 2, 10, QChar('0'));
+  part.insert = QString("insert or ignore into %1 (location_id, timestamp, value) values (?, ?, ?)")
+      .arg(part.name);
+  part.select = QString("select timestamp, value from %1 "
+                        "where location_id = ? and timestamp > ? and timestamp < ? order by timestamp")
+      .arg(part.name);
+  return part;
+}
+
+const MeasurementDatabase::PartitionMap& MeasurementDatabase::partitions(MetricId metric) {
+  if (!m_SchemaChecked) {
+    // other connections may have created or dropped partitions
+    auto r0 = prepare("pragma schema_version");
+    exec(r0);
+    const int version = r0.first() ? r0.value(0).toInt() : -1;
+    if (version != m_Partitions->schemaVersion) {
+      *m_Partitions = PartitionCache();
+      m_Partitions->schemaVersion = version;
+    }
+    m_SchemaChecked = true;
+  }
+
+  const int index = static_cast<int>(metric);
+  PartitionMap& parts = m_Partitions->maps[index];
+  if (m_Partitions->loaded[index]) {
+    return parts;
+  }
+
+  const Metric& desc = Metrics::get(metric);
+  auto r0 = prepare("select name from sqlite_master where type = 'table' and name glob ?");
+  r0.bindValue(0, QString("%1_[0-9][0-9][0-9][0-9][0-9][0-9]").arg(desc.storageName()));
+  exec(r0);
+  while (r0.next()) {
+    const auto suffix = r0.value(0).toString().right(6);
+    const int key = suffix.left(4).toInt() * 12 + suffix.right(2).toInt() - 1;
+    parts[key] = partition(desc, key);
+  }
+  m_Partitions->loaded[index] = true;
+
+  return parts;
+}
+
+MeasurementDatabase::Partition MeasurementDatabase::ensurePartition(MetricId metric, int key) {
+  const auto& parts = partitions(metric);
+  if (parts.contains(key)) {
+    return parts[key];
+  }
+
+  const auto part = partition(Metrics::get(metric), key);
+  const auto& name = part.name;
+  exec(QString("create table if not exists %1 ("
+               "id integer primary key, "
+               "location_id integer not null, "
+               "timestamp integer not null, "
+               "value real not null)").arg(name));
+  exec(QString("create unique index if not exists %1_location_timestamp on %1 (location_id, timestamp)")
+       .arg(name));
+
+  // the schema version moved, the next instance lists the partitions again
+  m_Partitions->maps[static_cast<int>(metric)][key] = part;
+  m_Partitions->schemaVersion = -1;
+  return part;
 }
 
 quint32 MeasurementDatabase::locationId(const QString& addr) {
@@ -77,7 +266,10 @@ quint32 MeasurementDatabase::locationId(const QString& addr) {
     return r0.value(0).toInt();
   }
 
-  // Not found, insert
+  // Not found, readers cannot insert. Ids start from 1.
+  if (m_Mode == Mode::ReadOnly) {
+    return 0;
+  }
 
   r0 = prepare("insert into location (address) values(?)");
   r0.bindValue(0, addr);
@@ -86,6 +278,13 @@ quint32 MeasurementDatabase::locationId(const QString& addr) {
   return r0.lastInsertId().toUInt();
 }
 
+QString MeasurementDatabase::address(quint32 locId) {
+  auto r0 = prepare("select address from location where id = ?");
+  r0.bindValue(0, locId);
+  exec(r0);
+  return r0.first() ? r0.value(0).toString() : QString();
+}
+
 QStringList MeasurementDatabase::addresses() {
   QStringList as;
   auto r0 = exec("select address from location");
@@ -95,61 +294,415 @@ QStringList MeasurementDatabase::addresses() {
   return as;
 }
 
-quint32 MeasurementDatabase::timestamp(quint32 locId, const QString& table) {
-  Q_ASSERT(m_DB.tables().contains(table));
-  auto sql = QString("select max(timestamp) from %1 where location_id = ?").arg(table);
-  auto r0 = prepare(sql);
+Measurement MeasurementDatabase::latest(quint32 locId, MetricId metric) {
+  const auto& parts = partitions(metric);
+  for (auto it = parts.cend(); it != parts.cbegin();) {
+    --it;
+    auto r0 = prepare(QString("select timestamp, value from %1 where location_id = ? "
+                              "order by timestamp desc limit 1").arg(it->name));
+    r0.bindValue(0, locId);
+    exec(r0);
+    if (r0.first()) {
+      return Measurement(r0.value(0).toUInt(), r0.value(1).toFloat());
+    }
+  }
+  return Measurement(0, 0);
+}
+
+quint32 MeasurementDatabase::timestamp(quint32 locId, MetricId metric) {
+  auto r0 = prepare("select timestamp from sync_state where location_id = ? and name = ?");
   r0.bindValue(0, locId);
+  r0.bindValue(1, Metrics::get(metric).storageName());
   exec(r0);
 
   if (r0.first()) {
-    return r0.value(0).toInt();
+    return r0.value(0).toUInt();
   }
 
   return 0;
 }
 
-void MeasurementDatabase::insertMeasurements(quint32 locId, const QString& table,
-                                             const MeasurementVector& measurements) {
+quint32 MeasurementDatabase::syncedUntil(quint32 locId) {
+  // A tag may not log every metric, those never get a watermark
+  auto r0 = prepare("select min(timestamp) from sync_state where location_id = ?");
+  r0.bindValue(0, locId);
+  exec(r0);
+
+  if (r0.first() && !r0.value(0).isNull()) {
+    return r0.value(0).toUInt();
+  }
 
-  Q_ASSERT(m_DB.tables().contains(table));
-  const auto sql = QString("insert into %1 (location_id, timestamp, value) values (?, ?, ?)")
-      .arg(table);
+  // never synced
+  return 0;
+}
+
+void MeasurementDatabase::updateSyncState(quint32 locId, MetricId metric, quint32 ts) {
+  auto r0 = prepare("insert into sync_state (location_id, name, timestamp) values (?, ?, ?) "
+                    "on conflict (location_id, name) do update set "
+                    "timestamp = max(timestamp, excluded.timestamp)");
+  r0.bindValue(0, locId);
+  r0.bindValue(1, Metrics::get(metric).storageName());
+  r0.bindValue(2, ts);
+  exec(r0);
+}
+
+int MeasurementDatabase::insertMeasurements(quint32 locId, MetricId metric,
+                                            const MeasurementVector& measurements, quint32 syncedTo) {
+
+  if (!transaction()) {
+    qWarning() << "Transactions not supported";
+  }
+
+  quint32 first;
+  quint32 last;
+  int inserted;
+  try {
+    inserted = insertRows(locId, metric, measurements, first, last);
+    if (syncedTo > 0) {
+      updateSyncState(locId, metric, syncedTo);
+    }
+  } catch (const DatabaseError&) {
+    rollback();
+    throw;
+  }
+
+  if (!commit()) {
+    qWarning() << "Transactions/Commits not supported";
+  }
+
+  if (inserted > 0) {
+    ChangeNotifier::publish(address(locId), metric, first, last);
+  }
+
+  return inserted;
+}
+
+int MeasurementDatabase::insertMeasurements(MetricId metric, const SeriesMap& series) {
 
   if (!transaction()) {
     qWarning() << "Transactions not supported";
   }
 
+  struct Change {
+    quint32 locId;
+    quint32 first;
+    quint32 last;
+  };
+  QVector<Change> changes;
+
+  int inserted = 0;
+  for (auto it = series.cbegin(); it != series.cend(); ++it) {
+    Change c {it.key(), 0, 0};
+    const int n = insertRows(c.locId, metric, it.value(), c.first, c.last);
+    if (n > 0) {
+      changes << c;
+    }
+    inserted += n;
+  }
+
+  if (!commit()) {
+    qWarning() << "Transactions/Commits not supported";
+  }
+
+  for (const Change& c: changes) {
+    ChangeNotifier::publish(address(c.locId), metric, c.first, c.last);
+  }
+
+  return inserted;
+}
+
+// Measurements already stored for the location and timestamp are skipped
+int MeasurementDatabase::insertRows(quint32 locId, MetricId metric, const MeasurementVector& measurements,
+                                    quint32& first, quint32& last) {
+  int inserted = 0;
+  first = std::numeric_limits<quint32>::max();
+  last = 0;
+  int current = -1;
+  QSqlQuery r0;
   for (const Measurement& m: measurements) {
-    auto r0 = prepare(sql);
+    first = std::min(first, m.ts);
+    last = std::max(last, m.ts);
+    const int key = monthKey(m.ts);
+    if (key != current) {
+      r0 = prepare(ensurePartition(metric, key).insert);
+      current = key;
+    }
     r0.bindValue(0, locId);
     r0.bindValue(1, m.ts);
     r0.bindValue(2, m.value);
     exec(r0);
+    inserted += r0.numRowsAffected();
   }
 
-  if (!commit()) {
-    qWarning() << "Transactions/Commits not supported";
+  if (inserted > 0) {
+    bumpVersion(locId, first, last);
+    // Backfilled rows below the retention watermark are aggregated on the next run
+    auto r1 = prepare("update retention set aggregated = min(aggregated, ?) "
+                      "where location_id = ? and name = ?");
+    r1.bindValue(0, first);
+    r1.bindValue(1, locId);
+    r1.bindValue(2, Metrics::get(metric).storageName());
+    exec(r1);
   }
+
+  return inserted;
 }
 
-MeasurementVector MeasurementDatabase::measurements(quint32 locId, const QString& table, quint32 start, quint32 end) {
-  Q_ASSERT(m_DB.tables().contains(table));
-  const auto sql = QString("select timestamp, value from %1 where location_id = ? and timestamp > ? and timestamp < ? order by timestamp")
-      .arg(table);
+template<typename Visitor>
+void MeasurementDatabase::forEachMeasurement(quint32 locId, MetricId metric, quint32 start, quint32 end,
+                                             Visitor&& visitor) {
+  if (start >= end) return;
 
-  // qDebug() << sql << locId << start << end;
+  const auto& parts = partitions(metric);
+  const int last = monthKey(end);
+  for (auto it = parts.lowerBound(monthKey(start)); it != parts.cend() && it.key() <= last; ++it) {
+    // qDebug() << it->select << locId << start << end;
 
-  auto r0 = prepare(sql);
-  r0.bindValue(0, locId);
-  r0.bindValue(1, start);
-  r0.bindValue(2, end);
-  exec(r0);
+    auto r0 = prepare(it->select);
+    r0.bindValue(0, locId);
+    r0.bindValue(1, start);
+    r0.bindValue(2, end);
+    exec(r0);
 
+    while (r0.next()) {
+      visitor(r0.value(0).toUInt(), r0.value(1).toFloat());
+    }
+  }
+}
+
+MeasurementVector MeasurementDatabase::measurements(quint32 locId, MetricId metric, quint32 start, quint32 end) {
   MeasurementVector results;
-  while (r0.next()) {
-    results << Measurement(r0.value(0).toUInt(), r0.value(1).toDouble());
+  if (start < end) {
+    results.reserve(std::min<quint32>((end - start) / ExpectedIntervalSecs + 1, MaxReserved));
+  }
+  forEachMeasurement(locId, metric, start, end, [&results] (quint32 ts, float value) {
+    results.append(Measurement(ts, value));
+  });
+  return results;
+}
+
+SeriesMap MeasurementDatabase::measurements(const QVector<quint32>& locIds, MetricId metric,
+                                           quint32 start, quint32 end) {
+  SeriesMap results;
+  if (locIds.isEmpty() || start >= end) return results;
+
+  for (const auto locId: locIds) {
+    results[locId].reserve(std::min<quint32>((end - start) / ExpectedIntervalSecs + 1, MaxReserved));
+  }
+
+  QStringList params;
+  for (int i = 0; i < locIds.size(); i++) {
+    params << "?";
+  }
+
+  const auto& parts = partitions(metric);
+  const int last = monthKey(end);
+  for (auto it = parts.lowerBound(monthKey(start)); it != parts.cend() && it.key() <= last; ++it) {
+    auto r0 = prepare(QString("select location_id, timestamp, value from %1 "
+                              "where location_id in (%2) and timestamp > ? and timestamp < ? "
+                              "order by location_id, timestamp").arg(it->name).arg(params.join(", ")));
+    int index = 0;
+    for (const auto locId: locIds) {
+      r0.bindValue(index++, locId);
+    }
+    r0.bindValue(index++, start);
+    r0.bindValue(index, end);
+    exec(r0);
+
+    MeasurementVector* current = nullptr;
+    quint32 currentId = 0;
+    while (r0.next()) {
+      const quint32 locId = r0.value(0).toUInt();
+      if (current == nullptr || locId != currentId) {
+        current = &results[locId];
+        currentId = locId;
+      }
+      current->append(Measurement(r0.value(1).toUInt(), r0.value(2).toFloat()));
+    }
   }
 
   return results;
 }
+
+void MeasurementDatabase::visitMeasurements(quint32 locId, MetricId metric, quint32 start, quint32 end,
+                                            const MeasurementVisitor& visitor) {
+  forEachMeasurement(locId, metric, start, end, [&visitor] (quint32 ts, float value) {
+    visitor(Measurement(ts, value));
+  });
+}
+
+void MeasurementDatabase::applyRetention(quint32 locId, const RetentionPolicy& policy, quint32 now) {
+  expire(policy, now);
+
+  if (policy.keepRawSecs > 0 && policy.aggregateSecs > 0 && now > policy.keepRawSecs) {
+    for (const Metric& metric: Metrics::all) {
+      downsample(locId, metric.id, policy, now);
+    }
+  }
+
+  releasePages();
+}
+
+void MeasurementDatabase::releasePages() {
+  auto r0 = exec("pragma freelist_count");
+  const int pages = r0.first() ? std::min(r0.value(0).toInt(), MaxReleasedPages) : 0;
+  r0.finish();
+  if (pages == 0) return;
+
+  // The pragma frees one page per step and QSqlQuery steps it only once
+  // per exec
+  auto r1 = prepare("pragma incremental_vacuum");
+  for (int i = 0; i < pages; i++) {
+    exec(r1);
+  }
+  r1.finish();
+}
+
+void MeasurementDatabase::expire(const RetentionPolicy& policy, quint32 now) {
+  if (policy.expireMonths == 0) return;
+
+  const int oldest = monthKey(now) - policy.expireMonths;
+  for (const Metric& metric: Metrics::all) {
+    const auto parts = partitions(metric.id);
+    for (auto it = parts.cbegin(); it != parts.cend() && it.key() < oldest; ++it) {
+      qInfo() << "Dropping expired partition" << it->name;
+      exec(QString("drop table %1").arg(it->name));
+      m_Partitions->maps[static_cast<int>(metric.id)].remove(it.key());
+      m_Partitions->schemaVersion = -1;
+      bumpVersion(0, monthStart(it.key()), monthStart(it.key()));
+      for (const auto& addr: addresses()) {
+        ChangeNotifier::publish(addr, metric.id, monthStart(it.key()), monthStart(it.key() + 1) - 1);
+      }
+    }
+  }
+}
+
+void MeasurementDatabase::bumpVersion(quint32 locId, quint32 from, quint32 to) {
+  // location id 0 bumps all locations
+  const auto sql = locId == 0 ?
+        QString("insert into data_version (location_id, month, version) select id, ?, 1 from location "
+                "where true on conflict (location_id, month) do update set version = version + 1") :
+        QString("insert into data_version (location_id, month, version) values (?, ?, 1) "
+                "on conflict (location_id, month) do update set version = version + 1");
+  for (int key = monthKey(from); key <= monthKey(to); key++) {
+    auto r0 = prepare(sql);
+    int index = 0;
+    if (locId != 0) {
+      r0.bindValue(index++, locId);
+    }
+    r0.bindValue(index, key);
+    exec(r0);
+  }
+}
+
+qint64 MeasurementDatabase::dataVersion(quint32 locId, quint32 start, quint32 end) {
+  auto r0 = prepare("select coalesce(sum(version), 0) from data_version "
+                    "where location_id = ? and month >= ? and month <= ?");
+  r0.bindValue(0, locId);
+  r0.bindValue(1, monthKey(start));
+  r0.bindValue(2, monthKey(end));
+  exec(r0);
+
+  if (r0.first()) {
+    return r0.value(0).toLongLong();
+  }
+  return 0;
+}
+
+void MeasurementDatabase::downsample(quint32 locId, MetricId metric,
+                                     const RetentionPolicy& policy, quint32 now) {
+  const quint32 agg = policy.aggregateSecs;
+  const quint32 cutoff = (now - policy.keepRawSecs) / agg * agg;
+
+  auto r0 = prepare("select aggregated from retention where location_id = ? and name = ?");
+  r0.bindValue(0, locId);
+  r0.bindValue(1, Metrics::get(metric).storageName());
+  exec(r0);
+
+  quint32 from = 0;
+  if (r0.first()) {
+    // lowered by backfills, the bucket of an older aggregate is averaged again
+    from = r0.value(0).toUInt() / agg * agg;
+  } else {
+    const auto& parts = partitions(metric);
+    for (auto it = parts.cbegin(); it != parts.cend() && from == 0; ++it) {
+      r0 = prepare(QString("select min(timestamp) from %1 where location_id = ?").arg(it->name));
+      r0.bindValue(0, locId);
+      exec(r0);
+      if (r0.first() && !r0.value(0).isNull()) {
+        from = r0.value(0).toUInt() / agg * agg;
+      }
+    }
+    if (from == 0) return;
+  }
+
+  const quint32 to = std::min(cutoff, from + policy.maxBucketsPerRun * agg);
+  if (from >= to) return;
+
+  if (!transaction()) {
+    qWarning() << "Transactions not supported";
+  }
+
+  try {
+    replaceWithAverages(locId, metric, agg, from, to);
+  } catch (const DatabaseError&) {
+    rollback();
+    throw;
+  }
+
+  if (!commit()) {
+    qWarning() << "Transactions/Commits not supported";
+  }
+
+  ChangeNotifier::publish(address(locId), metric, from, to);
+}
+
+void MeasurementDatabase::replaceWithAverages(quint32 locId, MetricId metric,
+                                              quint32 agg, quint32 from, quint32 to) {
+  // Averages go through a temporary table so that the raw rows in
+  // [from, to) can be deleted without touching the new aggregates.
+  exec("create temp table if not exists aggregate ("
+       "timestamp integer not null, "
+       "value real not null)");
+
+  const auto& parts = partitions(metric);
+  const int last = monthKey(to - 1);
+  for (auto it = parts.lowerBound(monthKey(from)); it != parts.cend() && it.key() <= last; ++it) {
+    const quint32 lo = std::max(from, monthStart(it.key()));
+    const quint32 hi = std::min(to, monthStart(it.key() + 1));
+
+    exec("delete from temp.aggregate");
+
+    // Buckets straddling a month boundary stay in their partition
+    auto r1 = prepare(QString("insert into temp.aggregate (timestamp, value) "
+                              "select max(?, min(?, timestamp / %1 * %1 + %2)), avg(value) from %3 "
+                              "where location_id = ? and timestamp >= ? and timestamp < ? "
+                              "group by timestamp / %1").arg(agg).arg(agg / 2).arg(it->name));
+    r1.bindValue(0, lo);
+    r1.bindValue(1, hi - 1);
+    r1.bindValue(2, locId);
+    r1.bindValue(3, lo);
+    r1.bindValue(4, hi);
+    exec(r1);
+
+    r1 = prepare(QString("delete from %1 where location_id = ? and timestamp >= ? and timestamp < ?")
+                 .arg(it->name));
+    r1.bindValue(0, locId);
+    r1.bindValue(1, lo);
+    r1.bindValue(2, hi);
+    exec(r1);
+
+    r1 = prepare(QString("insert or ignore into %1 (location_id, timestamp, value) "
+                         "select ?, timestamp, value from temp.aggregate").arg(it->name));
+    r1.bindValue(0, locId);
+    exec(r1);
+  }
+
+  bumpVersion(locId, from, to - 1);
+
+  auto r2 = prepare("insert or replace into retention (location_id, name, aggregated) values (?, ?, ?)");
+  r2.bindValue(0, locId);
+  r2.bindValue(1, Metrics::get(metric).storageName());
+  r2.bindValue(2, to);
+  exec(r2);
+}
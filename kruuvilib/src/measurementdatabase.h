@@ -20,6 +20,11 @@
 #pragma once
 
 #include "sqlitedatabase.h"
+#include "metrics.h"
+
+#include <QHash>
+#include <functional>
+#include <memory>
 
 struct Measurement {
   Measurement(quint32 stamp, float v)
@@ -30,25 +35,116 @@ struct Measurement {
 };
 
 using MeasurementVector = QVector<Measurement>;
+// by location id
+using SeriesMap = QHash<quint32, MeasurementVector>;
+using MeasurementVisitor = std::function<void (const Measurement&)>;
+
+// Raw measurements older than keepRawSecs are replaced by their averages
+// over aggregateSecs long buckets. At most maxBucketsPerRun buckets are
+// processed per location and table in one run. Rows inserted below the
+// aggregated range move its start back, so backfills are aggregated too.
+// Monthly partitions older than expireMonths are dropped.
+struct RetentionPolicy {
+  quint32 keepRawSecs = 90 * 24 * 3600; // 0: keep everything
+  quint32 aggregateSecs = 3600;
+  quint32 maxBucketsPerRun = 30 * 24;
+  quint32 expireMonths = 0; // 0: never
+};
 
 
+// Measurements are stored in monthly partitions, one table per metric
+// and month, e.g. temperature_202210. The partitions are listed once per
+// connection and again only when the schema version changes. Range reads
+// and inserts only touch the partitions overlapping the requested time
+// range. There is at most one measurement per location and timestamp in
+// each partition. Committed changes are published with ChangeNotifier.
 class MeasurementDatabase: public SQLiteDatabase {
 public:
 
   static void createTables();
 
-  MeasurementDatabase(const QString& connName);
+  MeasurementDatabase(const QString& purpose, Mode mode = Mode::ReadWrite);
   ~MeasurementDatabase() = default;
 
   quint32 locationId(const QString& addr);
-  quint32 timestamp(quint32 locId, const QString& table);
-  void insertMeasurements(quint32 locId, const QString& table, const MeasurementVector& measurements);
+  // Sync watermark: how far the tag log has been downloaded for the
+  // location and metric
+  quint32 timestamp(quint32 locId, MetricId metric);
+  // The oldest of the above over the metrics the tag has logged, 0 if none
+  quint32 syncedUntil(quint32 locId);
+  // Returns the number of new measurements. The log download passes
+  // syncedTo to advance the watermark in the same transaction. Other
+  // sources, such as the gateway or imports, may be sparser than the tag
+  // log and leave it alone.
+  int insertMeasurements(quint32 locId, MetricId metric, const MeasurementVector& measurements,
+                         quint32 syncedTo = 0);
+  // Inserts the series of many locations in one transaction
+  int insertMeasurements(MetricId metric, const SeriesMap& series);
   QStringList addresses();
+  // The most recent measurement, timestamp 0 if there is none
+  Measurement latest(quint32 locId, MetricId metric);
+
+  MeasurementVector measurements(quint32 locId, MetricId metric, quint32 start, quint32 end);
+  // One range scan per partition for all the locations
+  SeriesMap measurements(const QVector<quint32>& locIds, MetricId metric, quint32 start, quint32 end);
+  // Streams the measurements in timestamp order without collecting them
+  void visitMeasurements(quint32 locId, MetricId metric, quint32 start, quint32 end,
+                         const MeasurementVisitor& visitor);
 
-  MeasurementVector measurements(quint32 locId, const QString& table, quint32 start, quint32 end);
+  void applyRetention(quint32 locId, const RetentionPolicy& policy, quint32 now);
+
+  // Grows with every change to the months overlapping [start, end],
+  // including changes made while no reader was running
+  qint64 dataVersion(quint32 locId, quint32 start, quint32 end);
 
 private:
 
+  struct Partition {
+    QString name;
+    QString insert;
+    QString select;
+  };
 
-};
+  // months since year 0
+  using PartitionMap = QMap<int, Partition>;
+
+  // Shared by the instances using the same connection
+  struct PartitionCache {
+    int schemaVersion = -1;
+    std::array<PartitionMap, Metrics::count> maps;
+    std::array<bool, Metrics::count> loaded = {};
+  };
 
+  static int monthKey(quint32 ts);
+  static quint32 monthStart(int key);
+  static Partition partition(const Metric& metric, int key);
+
+  const PartitionMap& partitions(MetricId metric);
+  Partition ensurePartition(MetricId metric, int key);
+
+  template<typename Visitor>
+  void forEachMeasurement(quint32 locId, MetricId metric, quint32 start, quint32 end, Visitor&& visitor);
+
+  // Without a transaction, first and last are the timestamp range of the input
+  int insertRows(quint32 locId, MetricId metric, const MeasurementVector& measurements,
+                 quint32& first, quint32& last);
+  QString address(quint32 locId);
+  void migrate();
+  void updateSyncState(quint32 locId, MetricId metric, quint32 ts);
+  void bumpVersion(quint32 locId, quint32 from, quint32 to);
+  void downsample(quint32 locId, MetricId metric, const RetentionPolicy& policy, quint32 now);
+  void replaceWithAverages(quint32 locId, MetricId metric, quint32 agg, quint32 from, quint32 to);
+  void expire(const RetentionPolicy& policy, quint32 now);
+  void releasePages();
+
+  static inline const int IncrementalVacuum = 2;
+  // 16 MiB with the default page size
+  static inline const int MaxReleasedPages = 4096;
+  static inline const int SchemaVersion = 3;
+  // Used to size the result of a range read up front
+  static inline const quint32 ExpectedIntervalSecs = 300;
+  static inline const int MaxReserved = 1 << 20;
+
+  std::shared_ptr<PartitionCache> m_Partitions;
+  bool m_SchemaChecked = false;
+};
@@ -0,0 +1,76 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./kruuvilib/src/metrics.h
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <QString>
+#include <array>
+
+enum class MetricId: quint8 {Temperature, Humidity, Pressure};
+
+// Describes a measured quantity: the source byte in the RuuviTag log
+// protocol, the name used for storage, the scale from the raw log value,
+// the unit and the range of plausible values.
+struct Metric {
+  MetricId id;
+  quint8 source;
+  const char* name;
+  double scale;
+  const char* unit;
+  float min;
+  float max;
+
+  constexpr bool valid(float v) const {return v >= min && v <= max;}
+  QString storageName() const {return QString::fromLatin1(name);}
+};
+
+namespace Metrics {
+
+// Indexed by MetricId
+inline constexpr std::array<Metric, 3> all = {{
+  {MetricId::Temperature, 0x30, "temperature", .01, "°C", -40.f, 85.f},
+  {MetricId::Humidity, 0x31, "humidity", .01, "%", 0.f, 100.f},
+  {MetricId::Pressure, 0x32, "pressure", .01, "hPa", 300.f, 1100.f},
+}};
+
+inline constexpr int count = all.size();
+
+constexpr const Metric& get(MetricId id) {
+  return all[static_cast<int>(id)];
+}
+
+constexpr const Metric* fromSource(quint8 source) {
+  for (const Metric& m: all) {
+    if (m.source == source) return &m;
+  }
+  return nullptr;
+}
+
+inline const Metric* fromName(const QString& name) {
+  for (const Metric& m: all) {
+    if (name == QLatin1String(m.name)) return &m;
+  }
+  return nullptr;
+}
+
+}
+
+static_assert(Metrics::get(MetricId::Temperature).id == MetricId::Temperature);
+static_assert(Metrics::get(MetricId::Humidity).id == MetricId::Humidity);
+static_assert(Metrics::get(MetricId::Pressure).id == MetricId::Pressure);
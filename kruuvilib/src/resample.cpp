@@ -0,0 +1,65 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./kruuvilib/src/resample.cpp
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "resample.h"
+
+#include <limits>
+
+QVector<double> resample(const MeasurementVector& values, quint32 start, quint32 end,
+                         int samples, quint32 maxGap) {
+  constexpr double undefined = std::numeric_limits<double>::quiet_NaN();
+
+  QVector<double> results;
+  results.reserve(samples);
+
+  const double D = end - start;
+
+  if (!values.isEmpty()) {
+    double s = start + results.size() * D / samples;
+    while (s < values.first().ts && results.size() < samples) {
+      results << undefined;
+      s = start + results.size() * D / samples;
+    }
+
+    int i = 0;
+    while (results.size() < samples) {
+      const double s = start + results.size() * D / samples;
+      while (i < values.size() && values[i].ts <= s) i++;
+      if (i >= values.size()) break;
+      const double ds = values[i].ts - values[i - 1].ts;
+      if (ds > maxGap) {
+        results << undefined;
+      } else {
+        const double s0 = values[i - 1].ts;
+        const double s1 = values[i].ts;
+        const double v0 = values[i - 1].value;
+        const double v1 = values[i].value;
+
+        results << (s - s0) / ds * v1 + (s1 - s) / ds * v0;
+      }
+      i--;
+    }
+  }
+
+  while (results.size() < samples) {
+    results << undefined;
+  }
+
+  return results;
+}
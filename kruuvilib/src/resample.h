@@ -0,0 +1,28 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./kruuvilib/src/resample.h
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "measurementdatabase.h"
+
+// Linear interpolation of time ordered measurements at samples evenly
+// spaced instants starting from start. Instants before the first or after
+// the last measurement, or inside gaps longer than maxGap, are NaN.
+QVector<double> resample(const MeasurementVector& values, quint32 start, quint32 end,
+                         int samples, quint32 maxGap);
@@ -35,38 +35,101 @@ QString SQLiteDatabase::databaseName(const QString& bname) {
 
 
 
-SQLiteDatabase::SQLiteDatabase(const QString& connName) {
+SQLiteDatabase::Tuning SQLiteDatabase::m_Tuning;
+
+void SQLiteDatabase::setTuning(const Tuning& tuning) {
+  m_Tuning = tuning;
+}
+
+SQLiteDatabase::SQLiteDatabase(const QString& purpose, Mode mode)
+  : m_Mode(mode) {
+  const auto connName = ConnectionManager::connectionName(purpose);
   if (QSqlDatabase::contains(connName)) {
     m_DB = QSqlDatabase::database(connName, false);
   } else {
     m_DB = QSqlDatabase::addDatabase("QSQLITE", connName);
   }
+  m_Statements = ConnectionManager::statements(connName);
 }
 
 
+void SQLiteDatabase::open(const QString& path) {
+  if (m_DB.isOpen()) return;
+
+  auto options = QString("QSQLITE_BUSY_TIMEOUT=%1").arg(m_Tuning.busyTimeoutMSecs);
+  if (m_Mode == Mode::ReadOnly) {
+    options += ";QSQLITE_OPEN_READONLY";
+  }
+  m_DB.setConnectOptions(options);
+  m_DB.setDatabaseName(path);
+  if (!m_DB.open()) {
+    throw DatabaseError(m_DB.lastError().text());
+  }
+  m_Query = QSqlQuery(m_DB);
+
+  if (m_Mode == Mode::ReadWrite) {
+    // persistent, but cheap to repeat
+    exec("pragma journal_mode=WAL");
+    exec("pragma synchronous=NORMAL");
+  }
+  exec(QString("pragma mmap_size=%1").arg(m_Tuning.mmapSize));
+  exec(QString("pragma cache_size=%1").arg(-m_Tuning.cacheSizeKiB));
+}
+
+void SQLiteDatabase::checkpoint(bool truncate) {
+  if (m_Mode == Mode::ReadOnly) return;
+  exec(QString("pragma wal_checkpoint(%1)").arg(truncate ? "TRUNCATE" : "PASSIVE"));
+}
+
+qint64 SQLiteDatabase::dataVersion() {
+  auto r0 = prepare("pragma data_version");
+  exec(r0);
+  return r0.first() ? r0.value(0).toLongLong() : -1;
+}
+
 const QSqlQuery& SQLiteDatabase::exec(const QString& sql) {
+  // schema changes and checkpoints must not see active statements
+  resetStatements();
+
   m_Query = QSqlQuery(m_DB);
 
   m_Query.exec(sql);
-  checkError();
+  checkError(m_Query);
 
   return m_Query;
 }
 
 void SQLiteDatabase::exec(QSqlQuery& query) {
-  m_Query = query;
-  m_Query.exec();
-  checkError();
+  query.exec();
+  checkError(query);
 }
 
 const QSqlQuery& SQLiteDatabase::prepare(const QString& sql) {
+  if (auto cached = m_Statements->object(sql)) {
+    cached->finish();
+    m_Query = *cached;
+    return m_Query;
+  }
+
   m_Query = QSqlQuery(m_DB);
+  m_Query.setForwardOnly(true);
   m_Query.prepare(sql);
-  checkError();
+  checkError(m_Query);
+
+  m_Statements->insert(sql, new QSqlQuery(m_Query));
 
   return m_Query;
 }
 
+void SQLiteDatabase::resetStatements() {
+  for (const auto& sql: m_Statements->keys()) {
+    auto query = m_Statements->object(sql);
+    if (query->isActive()) {
+      query->finish();
+    }
+  }
+}
+
 bool SQLiteDatabase::transaction() {
   return m_DB.transaction();
 }
@@ -80,16 +143,21 @@ bool SQLiteDatabase::rollback() {
 }
 
 void SQLiteDatabase::close() {
+  m_Query = QSqlQuery();
+  m_Statements->clear();
   m_DB.commit();
   m_DB.close();
 }
 
 SQLiteDatabase::~SQLiteDatabase() {
   // qDebug() << "SQLiteDatabase::~SQLiteDatabase" << m_DB.connectionName();
-  close();
+  // The connection and its statements are reused by the next instance
+  m_Query = QSqlQuery();
+  resetStatements();
+  m_DB.commit();
 }
 
-void SQLiteDatabase::checkError() const {
-  if (!m_Query.lastError().isValid()) return;
-  throw DatabaseError(m_Query.lastError().text());
+void SQLiteDatabase::checkError(const QSqlQuery& query) {
+  if (!query.lastError().isValid()) return;
+  throw DatabaseError(query.lastError().text());
 }
@@ -21,6 +21,7 @@
 
 #include <QtSql/QSqlDatabase>
 #include <QtSql/QSqlQuery>
+#include "connectionmanager.h"
 
 class DatabaseError {
 public:
@@ -38,27 +39,59 @@ private:
   QString m_detail;
 };
 
+// The connections stay open until close() or the end of the thread.
+// Prepared statements are cached per connection and reused by SQL text,
+// the least recently used are dropped beyond ConnectionManager::MaxStatements.
+// The connection name is a purpose, each thread gets its own connection.
 class SQLiteDatabase {
 public:
 
+  enum class Mode {ReadWrite, ReadOnly};
+
+  struct Tuning {
+    int busyTimeoutMSecs = 5000;
+    qint64 mmapSize = 64 * 1024 * 1024;
+    int cacheSizeKiB = 8 * 1024;
+  };
+
   static QString databaseName(const QString& bname);
+  static void setTuning(const Tuning& tuning);
 
-  SQLiteDatabase(const QString& connName);
+  SQLiteDatabase(const QString& purpose, Mode mode = Mode::ReadWrite);
   virtual ~SQLiteDatabase();
 
   const QSqlQuery& exec(const QString& sql);
+  // Returns a cached forward only statement if the SQL has been prepared before
   const QSqlQuery& prepare(const QString& sql);
   void exec(QSqlQuery& query);
   bool transaction();
   bool commit();
   bool rollback();
   void close();
+  // Move WAL content to the database file. Passive checkpoints never
+  // wait for readers, truncating ones wait up to the busy timeout.
+  void checkpoint(bool truncate = false);
+  // Changes when another connection commits to the database
+  qint64 dataVersion();
 
 protected:
 
-  void checkError() const;
+  // Opens the connection in WAL mode with the configured busy timeout
+  // and page cache/mmap settings
+  void open(const QString& path);
+  static void checkError(const QSqlQuery& query);
 
   QSqlDatabase m_DB;
   QSqlQuery m_Query;
+  const Mode m_Mode;
+
+private:
+
+  // Unfinished selects would pin the read snapshot of the connection
+  void resetStatements();
+
+  static Tuning m_Tuning;
+
+  ConnectionManager::StatementCachePtr m_Statements;
 };
 
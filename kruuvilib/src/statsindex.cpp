@@ -0,0 +1,318 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./kruuvilib/src/statsindex.cpp
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "statsindex.h"
+
+#include <QDebug>
+#include <algorithm>
+#include <cmath>
+
+void StatsIndex::Summary::add(float v) {
+  count += 1;
+  sum += v;
+  min = std::min(min, v);
+  max = std::max(max, v);
+}
+
+void StatsIndex::Summary::add(const Summary& s) {
+  count += s.count;
+  sum += s.sum;
+  min = std::min(min, s.min);
+  max = std::max(max, s.max);
+}
+
+StatsIndex::StatsIndex(const QString& purpose)
+  : m_Purpose(purpose) {}
+
+quint64 StatsIndex::key(quint32 locId, MetricId metric) {
+  return (static_cast<quint64>(locId) << 8) | static_cast<quint8>(metric);
+}
+
+Stats StatsIndex::stats(quint32 locId, MetricId metric, quint32 start, quint32 end) {
+  Stats result;
+  if (start >= end) return result;
+
+  MeasurementDatabase db(m_Purpose, MeasurementDatabase::Mode::ReadOnly);
+  refresh(db);
+  const Series& s = series(db, locId, metric, start);
+
+  Summary total;
+  window(s, start, end, [&total] (float v) {
+    total.add(v);
+  }, [this, &s, &total] (int lo, int hi) {
+    total.add(query(s, lo, hi));
+  });
+
+  if (total.count > 0) {
+    result.count = total.count;
+    result.min = total.min;
+    result.max = total.max;
+    result.mean = total.sum / total.count;
+  }
+  return result;
+}
+
+float StatsIndex::percentile(quint32 locId, MetricId metric, quint32 start, quint32 end, double p) {
+  if (start >= end) return std::numeric_limits<float>::quiet_NaN();
+
+  MeasurementDatabase db(m_Purpose, MeasurementDatabase::Mode::ReadOnly);
+  refresh(db);
+  const Series& s = series(db, locId, metric, start);
+
+  QVector<float> edges;
+  int flo = 0;
+  int fhi = 0;
+  window(s, start, end, [&edges] (float v) {
+    edges << v;
+  }, [&flo, &fhi] (int lo, int hi) {
+    flo = lo;
+    fhi = hi;
+  });
+  std::sort(edges.begin(), edges.end());
+
+  Summary total = query(s, flo, fhi);
+  for (float v: edges) {
+    total.add(v);
+  }
+  if (total.count == 0) return std::numeric_limits<float>::quiet_NaN();
+
+  const quint32 k = std::lround(std::clamp(p, 0., 1.) * (total.count - 1));
+
+  // Number of values <= x, binary searched in each block
+  auto countLE = [&] (float x) {
+    quint32 c = std::upper_bound(edges.cbegin(), edges.cend(), x) - edges.cbegin();
+    for (int b = flo; b < fhi; b++) {
+      const auto& sorted = s.blocks[b].sorted;
+      c += std::upper_bound(sorted.cbegin(), sorted.cend(), x) - sorted.cbegin();
+    }
+    return c;
+  };
+
+  // The k'th value is the smallest x with more than k values <= x
+  float lo = total.min;
+  float hi = total.max;
+  if (countLE(lo) > k) return lo;
+  for (int i = 0; i < MaxBisections; i++) {
+    const float mid = lo + (hi - lo) / 2;
+    if (mid <= lo || mid >= hi) break;
+    if (countLE(mid) > k) {
+      hi = mid;
+    } else {
+      lo = mid;
+    }
+  }
+  return hi;
+}
+
+template<typename Rows, typename Full>
+void StatsIndex::window(const Series& s, quint32 start, quint32 end, Rows&& rows, Full&& full) const {
+  const qint64 size = s.blocks.size();
+  const qint64 b0 = static_cast<qint64>(start / BlockSecs) - s.first;
+  const qint64 b1 = static_cast<qint64>((end - 1) / BlockSecs) - s.first;
+
+  auto partial = [&] (qint64 b) {
+    if (b < 0 || b >= size) return;
+    for (const Measurement& m: s.blocks[b].rows) {
+      if (m.ts >= start && m.ts < end) {
+        rows(m.value);
+      }
+    }
+  };
+
+  if (b0 == b1) {
+    partial(b0);
+    return;
+  }
+
+  const qint64 lo = start % BlockSecs == 0 ? b0 : b0 + 1;
+  const qint64 hi = end % BlockSecs == 0 ? b1 + 1 : b1;
+  if (lo != b0) partial(b0);
+  if (hi != b1 + 1) partial(b1);
+
+  const int clo = std::clamp<qint64>(lo, 0, size);
+  const int chi = std::clamp<qint64>(hi, 0, size);
+  if (clo < chi) {
+    full(clo, chi);
+  }
+}
+
+StatsIndex::Series& StatsIndex::series(MeasurementDatabase& db, quint32 locId, MetricId metric, quint32 start) {
+  const quint32 startBlock = start / BlockSecs;
+
+  auto it = m_Series.find(key(locId, metric));
+  if (it == m_Series.end()) {
+    it = m_Series.insert(key(locId, metric), Series());
+    Series& s = it.value();
+    s.first = startBlock;
+    s.watermark = db.latest(locId, metric).ts;
+    if (s.watermark >= start) {
+      load(db, locId, metric, s, startBlock * BlockSecs, s.watermark + 1);
+    }
+    rebuild(s);
+    return s;
+  }
+
+  Series& s = it.value();
+  if (startBlock < s.first) {
+    // extend to the past
+    Series head;
+    head.first = startBlock;
+    load(db, locId, metric, head, startBlock * BlockSecs, s.first * BlockSecs);
+    head.blocks.resize(s.first - startBlock);
+    s.blocks = head.blocks + s.blocks;
+    s.first = startBlock;
+    rebuild(s);
+  }
+  return s;
+}
+
+void StatsIndex::invalidate(const QString& address, const QString& metric, quint32 from, quint32 to) {
+  const Metric* m = Metrics::fromName(metric);
+  if (m == nullptr || m_Series.isEmpty()) return;
+  if (m_Changes.size() >= MaxChanges) {
+    // not queried for a long time, start over
+    m_Series.clear();
+    m_Changes.clear();
+    return;
+  }
+  m_Changes << Change {address, m->id, from, to};
+}
+
+void StatsIndex::reload(MeasurementDatabase& db, const Change& c) {
+  const quint32 locId = db.locationId(c.address);
+  if (locId == 0) return;
+  auto it = m_Series.find(key(locId, c.metric));
+  if (it == m_Series.end()) return;
+
+  Series& s = it.value();
+  const qint64 lo = std::max<qint64>(static_cast<qint64>(c.from / BlockSecs) - s.first, 0);
+  const qint64 hi = std::min<qint64>(static_cast<qint64>(c.to / BlockSecs) - s.first, s.blocks.size() - 1);
+  if (lo > hi) return;
+
+  for (qint64 i = lo; i <= hi; i++) {
+    s.blocks[i] = Block();
+  }
+  load(db, locId, c.metric, s, (s.first + lo) * BlockSecs, (s.first + hi + 1) * BlockSecs);
+  for (qint64 i = lo; i <= hi; i++) {
+    update(s, i);
+  }
+}
+
+void StatsIndex::refresh(MeasurementDatabase& db) {
+  for (const Change& c: m_Changes) {
+    reload(db, c);
+  }
+  m_Changes.clear();
+
+  const auto version = db.dataVersion();
+  if (version == m_DataVersion) return;
+  m_DataVersion = version;
+
+  for (auto it = m_Series.begin(); it != m_Series.end(); ++it) {
+    const quint32 locId = it.key() >> 8;
+    const auto metric = static_cast<MetricId>(it.key() & 0xff);
+    Series& s = it.value();
+
+    const quint32 watermark = db.latest(locId, metric).ts;
+    if (watermark <= s.watermark) continue;
+
+    // The tag log may fill gaps before the previous watermark
+    const quint32 horizon = s.watermark > RefreshSecs ? s.watermark - RefreshSecs : 0;
+    const quint32 from = std::max(s.first, horizon / BlockSecs);
+    const int index = from - s.first;
+    const int oldSize = s.blocks.size();
+    if (index < oldSize) {
+      s.blocks.resize(index);
+    }
+    load(db, locId, metric, s, from * BlockSecs, watermark + 1);
+    s.watermark = watermark;
+
+    if (s.blocks.size() > s.capacity) {
+      rebuild(s);
+    } else {
+      for (int i = index; i < std::max(oldSize, s.blocks.size()); i++) {
+        update(s, i);
+      }
+    }
+  }
+}
+
+void StatsIndex::load(MeasurementDatabase& db, quint32 locId, MetricId metric, Series& s,
+                      quint32 from, quint32 to) {
+  int lo = s.blocks.size();
+  int hi = -1;
+  // visitMeasurements bounds are exclusive
+  db.visitMeasurements(locId, metric, from > 0 ? from - 1 : 0, to, [&] (const Measurement& m) {
+    const int index = m.ts / BlockSecs - s.first;
+    if (index >= s.blocks.size()) {
+      s.blocks.resize(index + 1);
+    }
+    Block& b = s.blocks[index];
+    b.rows << m;
+    b.summary.add(m.value);
+    lo = std::min(lo, index);
+    hi = std::max(hi, index);
+  });
+
+  for (int i = lo; i <= hi; i++) {
+    Block& b = s.blocks[i];
+    b.sorted.resize(b.rows.size());
+    std::transform(b.rows.cbegin(), b.rows.cend(), b.sorted.begin(), [] (const Measurement& m) {
+      return m.value;
+    });
+    std::sort(b.sorted.begin(), b.sorted.end());
+  }
+}
+
+void StatsIndex::rebuild(Series& s) {
+  int capacity = 1;
+  while (capacity < s.blocks.size()) capacity *= 2;
+  s.capacity = capacity;
+
+  s.tree = QVector<Summary>(2 * capacity);
+  for (int i = 0; i < s.blocks.size(); i++) {
+    s.tree[capacity + i] = s.blocks[i].summary;
+  }
+  for (int i = capacity - 1; i > 0; i--) {
+    s.tree[i] = s.tree[2 * i];
+    s.tree[i].add(s.tree[2 * i + 1]);
+  }
+}
+
+void StatsIndex::update(Series& s, int index) {
+  int i = s.capacity + index;
+  s.tree[i] = index < s.blocks.size() ? s.blocks[index].summary : Summary();
+  for (i /= 2; i > 0; i /= 2) {
+    s.tree[i] = s.tree[2 * i];
+    s.tree[i].add(s.tree[2 * i + 1]);
+  }
+}
+
+StatsIndex::Summary StatsIndex::query(const Series& s, int lo, int hi) const {
+  Summary result;
+  lo += s.capacity;
+  hi += s.capacity;
+  while (lo < hi) {
+    if (lo & 1) result.add(s.tree[lo++]);
+    if (hi & 1) result.add(s.tree[--hi]);
+    lo /= 2;
+    hi /= 2;
+  }
+  return result;
+}
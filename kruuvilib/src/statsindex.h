@@ -0,0 +1,112 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./kruuvilib/src/statsindex.h
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "measurementdatabase.h"
+
+#include <QHash>
+#include <limits>
+
+struct Stats {
+  quint32 count = 0;
+  float min = std::numeric_limits<float>::quiet_NaN();
+  float max = std::numeric_limits<float>::quiet_NaN();
+  double mean = std::numeric_limits<double>::quiet_NaN();
+};
+
+// In-memory range aggregates per location and metric. The measurements
+// are grouped into hourly blocks and a segment tree over the block
+// summaries answers min/max/mean/count for any window in O(log n).
+// Only the partially covered blocks at the window edges are scanned.
+//
+// The index covers the windows asked so far. When the newest measurement of
+// a series advances, the blocks within the tag log horizon before the old
+// watermark are reloaded, which also picks up re-requested log gaps.
+// Older changes (imports, retention) are reloaded from the ranges passed
+// to invalidate, which the owners feed from their ChangeListener.
+class StatsIndex {
+public:
+
+  StatsIndex(const QString& purpose = "StatsIndex");
+
+  // Measurements in [start, end)
+  Stats stats(quint32 locId, MetricId metric, quint32 start, quint32 end);
+  // p in [0, 1], NaN if there are no measurements
+  float percentile(quint32 locId, MetricId metric, quint32 start, quint32 end, double p);
+  // The blocks overlapping [from, to] are reloaded on the next query
+  void invalidate(const QString& address, const QString& metric, quint32 from, quint32 to);
+
+  static inline const quint32 BlockSecs = 3600;
+  static inline const quint32 RefreshSecs = 10 * 24 * 3600;
+  static inline const int MaxBisections = 160;
+  static inline const int MaxChanges = 1024;
+
+private:
+
+  struct Summary {
+    quint32 count = 0;
+    double sum = 0;
+    float min = std::numeric_limits<float>::max();
+    float max = std::numeric_limits<float>::lowest();
+
+    void add(float v);
+    void add(const Summary& s);
+  };
+
+  struct Block {
+    MeasurementVector rows; // timestamp order
+    QVector<float> sorted;  // values in increasing order
+    Summary summary;
+  };
+
+  struct Series {
+    quint32 first = 0;   // block number of blocks[0]
+    quint32 watermark = 0;
+    QVector<Block> blocks;
+    QVector<Summary> tree; // leaves at capacity + i
+    int capacity = 0;
+  };
+
+  struct Change {
+    QString address;
+    MetricId metric;
+    quint32 from;
+    quint32 to;
+  };
+
+  Series& series(MeasurementDatabase& db, quint32 locId, MetricId metric, quint32 start);
+  void reload(MeasurementDatabase& db, const Change& c);
+  void refresh(MeasurementDatabase& db);
+  void load(MeasurementDatabase& db, quint32 locId, MetricId metric, Series& s, quint32 from, quint32 to);
+  void rebuild(Series& s);
+  void update(Series& s, int index);
+  Summary query(const Series& s, int lo, int hi) const;
+
+  // Calls f for the values of the window, full blocks as sorted arrays
+  template<typename Rows, typename Full>
+  void window(const Series& s, quint32 start, quint32 end, Rows&& rows, Full&& full) const;
+
+  static quint64 key(quint32 locId, MetricId metric);
+
+  const QString m_Purpose;
+  QHash<quint64, Series> m_Series;
+  QVector<Change> m_Changes;
+  qint64 m_DataVersion = -1;
+};
@@ -0,0 +1,260 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./logreader/src/logger.cpp
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "logger.h"
+
+#include <QDebug>
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QDateTime>
+#include <QJsonObject>
+#include <QJsonDocument>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QThread>
+#include <QVector>
+#include <cstdio>
+#include <algorithm>
+
+namespace {
+
+struct Record {
+  QtMsgType type = QtDebugMsg;
+  qint64 msecs = 0;
+  QString msg;
+  const char* function = nullptr;
+};
+
+const char* levelName(QtMsgType mt) {
+  switch (mt) {
+  case QtDebugMsg: return "D";
+  case QtInfoMsg: return "I";
+  case QtWarningMsg: return "W";
+  case QtCriticalMsg: return "C";
+  case QtFatalMsg: return "F";
+  }
+  return "?";
+}
+
+const char* jsonLevelName(QtMsgType mt) {
+  switch (mt) {
+  case QtDebugMsg: return "debug";
+  case QtInfoMsg: return "info";
+  case QtWarningMsg: return "warning";
+  case QtCriticalMsg: return "critical";
+  case QtFatalMsg: return "fatal";
+  }
+  return "unknown";
+}
+
+}
+
+struct Logger::Private {
+  QString path;
+  Format format = Format::Text;
+  qint64 maxSize = DefaultMaxSize;
+  int keep = DefaultKeep;
+
+  QFile* dest = nullptr;
+  QThread* writer = nullptr;
+
+  QMutex mutex;
+  QWaitCondition wakeup;
+  QVector<Record> ring;
+  int head = 0; // next record to write out
+  int size = 0;
+  int dropped = 0;
+  bool stopping = false;
+
+  // timestamp formatting cache, accessed only from the writer thread
+  qint64 cachedSecs = -1;
+  QString cachedStamp;
+};
+
+Logger* Logger::instance() {
+  static Logger* logger = new Logger;
+  return logger;
+}
+
+Logger::Logger()
+  : d(new Private) {}
+
+Logger::~Logger() {
+  delete d;
+}
+
+bool Logger::init(const QString& path, Format format, qint64 maxSize, int keep) {
+  if (path.isEmpty()) return false;
+
+  const QFileInfo info(path);
+  QDir dir("/");
+  if (!dir.mkpath(info.absolutePath())) {
+    qWarning() << "Cannot create" << info.absolutePath();
+    return false;
+  }
+
+  d->dest = new QFile(path);
+  if (!d->dest->open(QFile::WriteOnly | QFile::Append)) {
+    qWarning() << "Cannot open" << path;
+    return false;
+  }
+
+  d->path = info.absoluteFilePath();
+  d->format = format;
+  d->maxSize = maxSize;
+  d->keep = std::max(keep, 1);
+  d->ring.resize(Capacity);
+
+  d->writer = QThread::create([this] () {run();});
+  d->writer->start(QThread::LowPriority);
+
+  return true;
+}
+
+void Logger::shutdown() {
+  if (d->writer == nullptr) return;
+
+  qInstallMessageHandler(nullptr);
+
+  {
+    QMutexLocker lock(&d->mutex);
+    d->stopping = true;
+    d->wakeup.wakeOne();
+  }
+  d->writer->wait();
+  delete d->writer;
+  d->writer = nullptr;
+
+  d->dest->close();
+}
+
+void Logger::handler(QtMsgType mt, const QMessageLogContext& ctx, const QString& msg) {
+  instance()->append(mt, ctx, msg);
+  if (mt == QtFatalMsg) {
+    // abort follows, get everything on disk first
+    instance()->shutdown();
+  }
+}
+
+void Logger::append(QtMsgType mt, const QMessageLogContext& ctx, const QString& msg) {
+  const qint64 msecs = QDateTime::currentMSecsSinceEpoch();
+
+  QMutexLocker lock(&d->mutex);
+  if (d->size == Capacity) {
+    d->dropped += 1;
+    return;
+  }
+  Record& r = d->ring[(d->head + d->size) % Capacity];
+  r.type = mt;
+  r.msecs = msecs;
+  r.msg = msg;
+  r.function = ctx.function;
+  d->size += 1;
+
+  if (d->size > Capacity / 2 || mt >= QtWarningMsg) {
+    d->wakeup.wakeOne();
+  }
+}
+
+void Logger::run() {
+  QVector<Record> batch;
+  batch.reserve(Capacity);
+
+  bool done = false;
+  while (!done) {
+    int dropped = 0;
+    {
+      QMutexLocker lock(&d->mutex);
+      if (d->size == 0 && !d->stopping) {
+        d->wakeup.wait(&d->mutex, FlushMSecs);
+      }
+      while (d->size > 0) {
+        batch.append(std::move(d->ring[d->head]));
+        d->ring[d->head] = Record();
+        d->head = (d->head + 1) % Capacity;
+        d->size -= 1;
+      }
+      std::swap(dropped, d->dropped);
+      done = d->stopping;
+    }
+
+    if (batch.isEmpty() && dropped == 0) continue;
+
+    QByteArray bytes;
+    for (const Record& r: batch) {
+      if (d->format == Format::Json) {
+        QJsonObject obj;
+        obj["time"] = QDateTime::fromMSecsSinceEpoch(r.msecs).toString(Qt::ISODateWithMs);
+        obj["level"] = jsonLevelName(r.type);
+        obj["message"] = r.msg;
+        if (r.function != nullptr) {
+          obj["function"] = QString::fromLatin1(r.function);
+        }
+        bytes += QJsonDocument(obj).toJson(QJsonDocument::Compact);
+        bytes += '\n';
+      } else {
+        const qint64 secs = r.msecs / 1000;
+        if (secs != d->cachedSecs) {
+          d->cachedSecs = secs;
+          d->cachedStamp = QDateTime::fromSecsSinceEpoch(secs).toString("MMM dd hh:mm:ss");
+        }
+        bytes += QString("[%1] %2.%3: %4 (%5)\n")
+            .arg(QString::fromLatin1(levelName(r.type)),
+                 d->cachedStamp,
+                 QString("%1").arg(r.msecs % 1000, 3, 10, QChar('0')),
+                 r.msg,
+                 QString::fromLatin1(r.function)).toUtf8();
+      }
+    }
+    if (dropped > 0) {
+      bytes += QString("[W] %1 log messages dropped\n").arg(dropped).toUtf8();
+    }
+    batch.clear();
+
+    write(bytes);
+  }
+}
+
+void Logger::write(const QByteArray& bytes) {
+  if (d->dest->write(bytes) < 0) {
+    // cannot log from the writer thread
+    std::fprintf(stderr, "Logger: cannot write to %s\n", qPrintable(d->path));
+    return;
+  }
+  d->dest->flush();
+
+  if (d->maxSize > 0 && d->dest->size() > d->maxSize) {
+    rotate();
+  }
+}
+
+void Logger::rotate() {
+  d->dest->close();
+
+  QFile::remove(QString("%1.%2").arg(d->path).arg(d->keep));
+  for (int i = d->keep - 1; i > 0; i--) {
+    QFile::rename(QString("%1.%2").arg(d->path).arg(i), QString("%1.%2").arg(d->path).arg(i + 1));
+  }
+  QFile::rename(d->path, QString("%1.1").arg(d->path));
+
+  if (!d->dest->open(QFile::WriteOnly | QFile::Append)) {
+    std::fprintf(stderr, "Logger: cannot reopen %s\n", qPrintable(d->path));
+  }
+}
@@ -0,0 +1,58 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./logreader/src/logger.h
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <QString>
+
+// Message handler which queues log records into a ring buffer. A background
+// thread formats the records and appends them to the log file, rotating
+// the file when it grows beyond the size limit.
+class Logger {
+public:
+
+  enum class Format {Text, Json};
+
+  static Logger* instance();
+
+  bool init(const QString& path, Format format, qint64 maxSize, int keep);
+  // Flushes pending records, stops the writer thread and restores the default handler
+  void shutdown();
+
+  static void handler(QtMsgType mt, const QMessageLogContext& ctx, const QString& msg);
+
+  static inline const qint64 DefaultMaxSize = 1024 * 1024;
+  static inline const int DefaultKeep = 3;
+
+private:
+
+  Logger();
+  ~Logger();
+
+  void append(QtMsgType mt, const QMessageLogContext& ctx, const QString& msg);
+  void run();
+  void write(const QByteArray& bytes);
+  void rotate();
+
+  static inline const int Capacity = 4096;
+  static inline const int FlushMSecs = 500;
+
+  struct Private;
+  Private* const d;
+};
@@ -0,0 +1,564 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./logreader/src/logsession.cpp
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "logsession.h"
+#include <QDebug>
+#include <BluezQt/GattServiceRemote>
+#include <BluezQt/GattCharacteristicRemote>
+#include <BluezQt/PendingCall>
+#include <QDateTime>
+#include "measurementdatabase.h"
+#include "logrecord.h"
+#include "alerts.h"
+#include "tagcache.h"
+#include <QDBusConnection>
+#include <QDBusMessage>
+#include <QDBusPendingCallWatcher>
+#include <QDBusPendingReply>
+#include <QDBusVariant>
+#include <QDBusObjectPath>
+#include <QMap>
+#include <QTimer>
+#include <algorithm>
+#include <limits>
+
+using Gap = QPair<quint32, quint32>;
+using GapVector = QVector<Gap>;
+
+struct LogSession::Private {
+  BluezQt::AdapterPtr m_adapter;
+  BluezQt::DevicePtr m_tag = nullptr;
+  QStringList m_addresses;
+  QTimer* m_deviceSearchTimer = nullptr;
+  QTimer* m_errorTimer = nullptr;
+  BluezQt::GattCharacteristicRemotePtr m_nus_tx = nullptr;
+  BluezQt::GattCharacteristicRemotePtr m_nus_rx = nullptr;
+  LogRecord::Series m_measurements;
+  // notifications waiting for decoding
+  QVector<QByteArray> m_received;
+  RetentionPolicy m_retention;
+  quint32 m_logInterval;
+  quint32 m_requestedFrom = 0;
+  bool m_gapsChecked = false;
+  GapVector m_gaps;
+  // the records outside are dropped, a gap request returns everything after it
+  Gap m_accepted {0, std::numeric_limits<quint32>::max()};
+  bool m_finished = false;
+  TagCache* m_cache = nullptr;
+  Search m_search = Search::Full;
+  bool m_directConnect = true;
+};
+
+LogSession::LogSession(BluezQt::AdapterPtr adapter, const QStringList& addresses,
+                       const RetentionPolicy& retention, quint32 logInterval,
+                       TagCache* cache, QObject* parent)
+  : QObject(parent)
+  , d(new Private) {
+
+  d->m_adapter = adapter;
+  d->m_addresses = addresses;
+  d->m_retention = retention;
+  d->m_logInterval = logInterval;
+  d->m_cache = cache;
+
+  d->m_deviceSearchTimer = new QTimer(this);
+  d->m_deviceSearchTimer->setSingleShot(true);
+  connect(d->m_deviceSearchTimer, &QTimer::timeout, [this] () {
+    if (d->m_adapter->isDiscovering()) {
+      d->m_adapter->stopDiscovery();
+    }
+    switch (d->m_search) {
+    case Search::Direct:
+      search(Search::Targeted);
+      return;
+    case Search::Targeted:
+      search(Search::Full);
+      return;
+    case Search::Full:
+      qWarning() << d->m_addresses.first() << "Not found. Stop scan";
+      d->m_addresses.pop_front();
+      findDevice();
+      return;
+    }
+  });
+
+  d->m_errorTimer = new QTimer(this);
+  d->m_errorTimer->setSingleShot(true);
+  d->m_errorTimer->setInterval(WaitBeforeErrorMSecs);
+  connect(d->m_errorTimer, &QTimer::timeout, [this] () {
+    qWarning() << name() << "timeout in" << WaitBeforeErrorMSecs / 1000 << "secs, stopping";
+    finish();
+  });
+
+  connect(d->m_adapter.data(), &BluezQt::Adapter::deviceAdded, this, &LogSession::deviceAdded);
+  connect(this, &LogSession::deviceFound, this, &LogSession::readLog);
+}
+
+LogSession::~LogSession() {
+  delete d;
+}
+
+QString LogSession::name() const {
+  return d->m_adapter->name();
+}
+
+void LogSession::start() {
+  qInfo() << name() << "reading" << d->m_addresses.join(", ");
+  findDevice();
+}
+
+void LogSession::stop() {
+  d->m_deviceSearchTimer->stop();
+  d->m_errorTimer->stop();
+
+  if (d->m_adapter->isDiscovering()) {
+    // qInfo() << "Stop scan";
+    d->m_adapter->stopDiscovery();
+  }
+
+  if (d->m_tag != nullptr && d->m_tag->isConnected()) {
+    // qInfo() << "Disconnect";
+    d->m_tag->disconnectFromDevice();
+  }
+}
+
+void LogSession::finish() {
+  if (d->m_finished) return;
+  d->m_finished = true;
+
+  stop();
+  emit finished();
+}
+
+void LogSession::deviceAdded(BluezQt::DevicePtr p) {
+  if (!d->m_deviceSearchTimer->isActive()) return;
+
+  // qInfo() << "device added" << p->name() << p->address();
+  if (!d->m_addresses.isEmpty() && p->address() == d->m_addresses.first()) {
+    d->m_deviceSearchTimer->stop();
+    if (d->m_adapter->isDiscovering()) {
+      // qInfo() << "Stop scanning";
+      d->m_adapter->stopDiscovery();
+    }
+    connectDevice(p);
+  }
+}
+
+void LogSession::setupScan(const QString& pattern) {
+  // qDebug() << "Setup scan filter";
+
+  const QVariantMap dict {
+    {"Transport", "le"},
+    {"DuplicateData", true},
+    {"Pattern", pattern},
+  };
+
+  BluezQt::PendingCall* call = d->m_adapter->setDiscoveryFilter(dict);
+  connect(call, &BluezQt::PendingCall::finished, [this] (const BluezQt::PendingCall* rsp) {
+    if (rsp->error()) {
+      qWarning() << "Error setting up scan filter:" << rsp->errorText();
+    }
+    // the search may have timed out meanwhile
+    if (d->m_finished || !d->m_deviceSearchTimer->isActive()) return;
+    // qInfo() << "Start scan";
+    d->m_adapter->startDiscovery();
+  });
+}
+
+
+void LogSession::scan(const QString& pattern) {
+  if (!d->m_adapter->isPowered()) {
+    qWarning() << name() << "is not powered";
+    finish();
+    return;
+  }
+  setupScan(pattern);
+}
+
+void LogSession::findDevice() {
+  if (d->m_addresses.isEmpty()) {
+    finish();
+    return;
+  }
+  const auto addr = d->m_addresses.first();
+  auto p = d->m_adapter->deviceForAddress(addr);
+  if (p != nullptr) {
+    connectDevice(p);
+    return;
+  }
+  if (d->m_directConnect && d->m_cache->contains(addr)) {
+    search(Search::Direct);
+  } else {
+    search(Search::Targeted);
+  }
+}
+
+void LogSession::search(Search method) {
+  const auto addr = d->m_addresses.first();
+  d->m_search = method;
+  switch (method) {
+  case Search::Direct:
+    qInfo() << addr << "not known, connecting directly ..";
+    d->m_deviceSearchTimer->start(DirectConnectMSecs);
+    connectDirectly(addr);
+    return;
+  case Search::Targeted:
+    qInfo() << addr << "not known, scanning for it ..";
+    d->m_deviceSearchTimer->start(TargetedScanMSecs);
+    // the pattern matches the address too
+    scan(addr);
+    return;
+  case Search::Full:
+    qInfo() << addr << "not found, scanning ..";
+    d->m_deviceSearchTimer->start(StopScanMSecs);
+    scan("Ruuvi");
+    return;
+  }
+}
+
+void LogSession::connectDirectly(const QString& addr) {
+  // ConnectDevice is an experimental BlueZ API not wrapped by BluezQt
+  auto msg = QDBusMessage::createMethodCall("org.bluez", d->m_adapter->ubi(),
+                                            "org.bluez.Adapter1", "ConnectDevice");
+  const QVariantMap props {
+    {"Address", addr},
+    {"AddressType", d->m_cache->entry(addr).addressType},
+  };
+  msg << props;
+
+  auto watcher = new QDBusPendingCallWatcher(QDBusConnection::systemBus().asyncCall(msg), this);
+  connect(watcher, &QDBusPendingCallWatcher::finished, [this, addr] (QDBusPendingCallWatcher* w) {
+    w->deleteLater();
+    QDBusPendingReply<QDBusObjectPath> reply = *w;
+    if (d->m_search != Search::Direct || !d->m_deviceSearchTimer->isActive() ||
+        d->m_addresses.isEmpty() || d->m_addresses.first() != addr) {
+      return;
+    }
+    if (reply.isError()) {
+      qInfo() << "Direct connect failed:" << reply.error().message();
+      if (reply.error().type() == QDBusError::UnknownMethod) {
+        // bluetoothd runs without experimental features
+        d->m_directConnect = false;
+      }
+      d->m_deviceSearchTimer->stop();
+      search(Search::Targeted);
+      return;
+    }
+    // The device might not be visible yet in BluezQt: deviceAdded
+    // continues in that case
+    auto p = d->m_adapter->deviceForAddress(addr);
+    if (p != nullptr) {
+      d->m_deviceSearchTimer->stop();
+      connectDevice(p);
+    }
+  });
+}
+
+void LogSession::remember(BluezQt::DevicePtr p) {
+  // AddressType is not wrapped by BluezQt
+  auto msg = QDBusMessage::createMethodCall("org.bluez", p->ubi(),
+                                            "org.freedesktop.DBus.Properties", "Get");
+  msg << QString("org.bluez.Device1") << QString("AddressType");
+
+  const auto addr = p->address();
+  auto watcher = new QDBusPendingCallWatcher(QDBusConnection::systemBus().asyncCall(msg), this);
+  connect(watcher, &QDBusPendingCallWatcher::finished, [this, addr] (QDBusPendingCallWatcher* w) {
+    w->deleteLater();
+    QDBusPendingReply<QDBusVariant> reply = *w;
+    if (reply.isError()) return;
+    const auto addressType = reply.value().variant().toString();
+    if (addressType.isEmpty()) return;
+
+    TagCache::Entry e;
+    e.addressType = addressType;
+    e.adapter = d->m_adapter->address();
+    e.seen = QDateTime::currentSecsSinceEpoch();
+    d->m_cache->update(addr, e);
+  });
+}
+
+void LogSession::connectDevice(BluezQt::DevicePtr p) {
+  qInfo() << "connecting to" << p->address();
+  d->m_tag = p;
+
+  d->m_errorTimer->start();
+  auto call = d->m_tag->connectToDevice();
+  qInfo() << "connection to" << d->m_tag->address() << "in progress ...";
+  connect(call, &BluezQt::PendingCall::finished, [this] (const BluezQt::PendingCall* rsp) {
+    d->m_errorTimer->stop();
+    if (rsp->error()) {
+      qWarning() << "Error connecting:" << rsp->errorText();
+      finish();
+      return;
+    }
+    qInfo() << "connected to" << d->m_tag->address();
+    remember(d->m_tag);
+    d->m_errorTimer->start();
+    for (const auto srv: d->m_tag->gattServices()) {
+      setupNUS(srv);
+    }
+    connect(d->m_tag.data(), &BluezQt::Device::gattServiceAdded, this, &LogSession::setupNUS);
+    connect(d->m_tag.data(), &BluezQt::Device::gattServiceChanged, this, &LogSession::setupNUS);
+  });
+}
+
+void LogSession::setupNUS(BluezQt::GattServiceRemotePtr srv) {
+  if (d->m_nus_rx != nullptr && d->m_nus_tx != nullptr) {
+    return;
+  }
+  // qInfo() << "service uuid" << srv->uuid();
+  if (srv->uuid().toUpper() == NUSUUID) {
+    // qInfo() << "NUS found";
+    for (const auto ch: srv->characteristics()) {
+      if (ch->uuid().toUpper() == NUSUUID_RX && d->m_nus_rx == nullptr) {
+        qInfo() << "NUS_RX found";
+        d->m_nus_rx = ch;
+        connect(d->m_nus_rx.data(), &BluezQt::GattCharacteristicRemote::valueChanged,
+                this, &LogSession::handleRXNotify);
+      } else if (ch->uuid().toUpper() == NUSUUID_TX && d->m_nus_tx == nullptr) {
+        qInfo() << "NUS_TX found";
+        d->m_nus_tx = ch;
+      }
+    }
+  }
+  if (d->m_nus_rx != nullptr && d->m_nus_tx != nullptr) {
+    d->m_errorTimer->stop();
+    emit deviceFound();
+  }
+}
+
+void LogSession::readLog() {
+  if (d->m_nus_tx == nullptr || d->m_nus_rx == nullptr) {
+    qWarning() << "NUS not available, cannot read log";
+    finish();
+    return;
+  }
+
+  d->m_errorTimer->start();
+  auto call = d->m_nus_rx->startNotify();
+  qInfo() << "Start notify";
+  connect(call, &BluezQt::PendingCall::finished, [this] (const BluezQt::PendingCall* rsp) {
+    d->m_errorTimer->stop();
+    if (rsp->error()) {
+      qWarning() << "RX start notify failed:" << rsp->errorText();
+      finish();
+      return;
+    }
+
+    // Request everything after the least recently synced metric
+    MeasurementDatabase db("LogSession::readlog");
+    d->m_requestedFrom = db.syncedUntil(db.locationId(d->m_addresses.first()));
+
+    d->m_accepted = Gap(0, std::numeric_limits<quint32>::max());
+    requestLog(d->m_requestedFrom);
+  });
+}
+
+void LogSession::requestLog(quint32 then) {
+  const auto bytes = LogRecord::request(then, QDateTime::currentSecsSinceEpoch());
+
+  // qDebug() << bytes;
+  d->m_errorTimer->start();
+  auto call = d->m_nus_tx->writeValue(bytes, QVariantMap());
+  connect(call, &BluezQt::PendingCall::finished, [this] (const BluezQt::PendingCall* rsp) {
+    d->m_errorTimer->stop();
+    if (rsp->error()) {
+      qWarning() << "Error when writing:" << rsp->errorText();
+      finish();
+    }
+  });
+}
+
+GapVector LogSession::findGaps() const {
+  const quint32 maxStep = GapFactor * d->m_logInterval;
+
+  GapVector gaps;
+  for (const auto& values: d->m_measurements) {
+    QVector<quint32> stamps;
+    stamps.reserve(values.size());
+    for (const Measurement& m: values) {
+      stamps << m.ts;
+    }
+    std::sort(stamps.begin(), stamps.end());
+
+    // a missing beginning is a gap only if we know where the series should start
+    quint32 prev = d->m_requestedFrom;
+    for (const quint32 ts: stamps) {
+      if (prev > 0 && ts > prev + maxStep) {
+        gaps << Gap(prev, ts);
+      }
+      prev = ts;
+    }
+  }
+
+  // the log request covers all metrics, merge overlapping gaps
+  std::sort(gaps.begin(), gaps.end());
+  GapVector merged;
+  for (const Gap& g: gaps) {
+    if (!merged.isEmpty() && g.first <= merged.last().second) {
+      merged.last().second = std::max(merged.last().second, g.second);
+    } else {
+      merged << g;
+    }
+  }
+
+  if (merged.size() > MaxGapRequests) {
+    qWarning() << merged.size() << "gaps in the log, requesting the first" << MaxGapRequests;
+    merged.resize(MaxGapRequests);
+  }
+
+  return merged;
+}
+
+// Notifications which arrive in the same event loop round are decoded together
+void LogSession::handleRXNotify(const QByteArray value) {
+  // qDebug() << value;
+  if (d->m_received.isEmpty()) {
+    QTimer::singleShot(0, this, &LogSession::decodeReceived);
+  }
+  d->m_received << value;
+}
+
+void LogSession::decodeReceived() {
+  if (d->m_received.isEmpty() || d->m_tag == nullptr) {
+    d->m_received.clear();
+    return;
+  }
+
+  LogRecord::Series batch;
+  const auto r = LogRecord::decode(d->m_received, batch);
+  d->m_received.clear();
+  for (int i = 0; i < Metrics::count; i++) {
+    for (const Measurement& m: batch[i]) {
+      if (m.ts > d->m_accepted.first && m.ts < d->m_accepted.second) {
+        d->m_measurements[i] << m;
+      }
+    }
+  }
+  if (r.unsupported > 0) {
+    qWarning() << "Skipped" << r.unsupported << "records of unsupported measurement sources";
+  }
+  if (r.discarded > 0) {
+    qWarning() << "Discarded" << r.discarded << "values outside the metric ranges";
+  }
+  if (!r.end) return;
+
+  // Re-request the intervals lost in the main pass, once
+  if (!d->m_gapsChecked) {
+    d->m_gapsChecked = true;
+    d->m_gaps = findGaps();
+  }
+  if (!d->m_gaps.isEmpty()) {
+    const auto gap = d->m_gaps.takeFirst();
+    qInfo() << "Requesting missing log from" << QDateTime::fromSecsSinceEpoch(gap.first)
+            << "to" << QDateTime::fromSecsSinceEpoch(gap.second);
+    d->m_accepted = gap;
+    requestLog(gap.first);
+    return;
+  }
+
+  qInfo() << "Finished reading log from" << d->m_tag->address();
+  updateDB();
+
+  d->m_errorTimer->start();
+  auto call = d->m_nus_rx->stopNotify();
+  connect(call, &BluezQt::PendingCall::finished, [this] (const BluezQt::PendingCall* rsp) {
+    d->m_errorTimer->stop();
+    if (rsp->error()) {
+      qWarning() << "RX stop notify failed:" << rsp->errorText();
+    }
+    if (d->m_finished) return;
+
+    d->m_addresses.pop_front();
+    if (d->m_addresses.isEmpty()) {
+      finish();
+    } else {
+      disconnectDevice();
+    }
+  });
+}
+
+void LogSession::disconnectDevice() {
+  qInfo() << "Disconnect";
+  auto call = d->m_tag->disconnectFromDevice();
+  connect(call, &BluezQt::PendingCall::finished, [this] () {
+    if (d->m_finished) return;
+    findDevice();
+  });
+  d->m_tag = nullptr;
+  d->m_nus_rx = nullptr;
+  d->m_nus_tx = nullptr;
+  for (auto& values: d->m_measurements) {
+    values.clear();
+  }
+  d->m_received.clear();
+  d->m_requestedFrom = 0;
+  d->m_gapsChecked = false;
+  d->m_gaps.clear();
+  d->m_accepted = Gap(0, std::numeric_limits<quint32>::max());
+}
+
+void LogSession::updateDB() {
+  qInfo() << "Update DB";
+  MeasurementDatabase db("LogSession::updateDB");
+  const auto addr = d->m_addresses.first();
+  const auto locId = db.locationId(addr);
+
+  // Only the samples newer than the watermark are evaluated
+  AlertEngine alerts;
+  AlertEvents events;
+  if (!alerts.isEmpty()) {
+    alerts.loadState(db, addr);
+  }
+
+  for (const Metric& metric: Metrics::all) {
+    const auto mid = metric.id;
+
+    auto values = d->m_measurements[static_cast<int>(mid)];
+    if (values.isEmpty()) continue;
+    std::sort(values.begin(), values.end(), [] (const Measurement& a, const Measurement& b) {
+      return a.ts < b.ts;
+    });
+
+    // qDebug() << "Considering" << values.size() << "measurements to" << addr << Metrics::get(mid).name;
+    const auto ts = db.timestamp(locId, mid);
+    while (!values.isEmpty() && values.first().ts < ts) {
+      values.pop_front();
+    }
+    // qDebug() << "Inserting" << values.size() << "measurements to" << addr << Metrics::get(mid).name;
+    db.insertMeasurements(locId, mid, values, values.isEmpty() ? 0 : values.last().ts);
+    events << alerts.evaluate(addr, mid, values);
+  }
+
+  if (!alerts.isEmpty()) {
+    try {
+      alerts.save(db, events);
+    } catch (const DatabaseError& e) {
+      qWarning() << "Cannot save alerts:" << e.msg();
+    }
+    // the dataengine notifies the desktop
+    for (const AlertEvent& e: events) {
+      qInfo() << e.message();
+    }
+  }
+
+  db.applyRetention(locId, d->m_retention, QDateTime::currentSecsSinceEpoch());
+
+  db.checkpoint();
+}
@@ -0,0 +1,98 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./logreader/src/logsession.h
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <BluezQt/Adapter>
+#include <BluezQt/Device>
+#include <QVector>
+#include <QPair>
+
+struct RetentionPolicy;
+class TagCache;
+
+// Reads the measurement logs of RuuviTags one after another using one
+// bluetooth adapter. Emits finished when all tags have been handled or
+// on the first error.
+class LogSession: public QObject {
+
+  Q_OBJECT
+
+public:
+
+  LogSession(BluezQt::AdapterPtr adapter, const QStringList& addresses,
+             const RetentionPolicy& retention, quint32 logInterval,
+             TagCache* cache, QObject* parent = nullptr);
+  ~LogSession();
+
+  QString name() const;
+
+public slots:
+
+  void start();
+  void stop();
+
+signals:
+
+  void deviceFound();
+  void finished();
+
+private slots:
+
+  void findDevice();
+  void readLog();
+  void deviceAdded(BluezQt::DevicePtr device);
+  void handleRXNotify(const QByteArray value);
+  void decodeReceived();
+  void setupNUS(BluezQt::GattServiceRemotePtr srv);
+
+private:
+
+  // Ways to reach a tag which BlueZ does not know, fastest first
+  enum class Search {Direct, Targeted, Full};
+
+  static inline const QString NUSUUID = "6E400001-B5A3-F393-E0A9-E50E24DCCA9E";
+  static inline const QString NUSUUID_TX = "6E400002-B5A3-F393-E0A9-E50E24DCCA9E";
+  static inline const QString NUSUUID_RX = "6E400003-B5A3-F393-E0A9-E50E24DCCA9E";
+  // the record layout is in LogRecord, the sources in the metric registry
+  static inline const int StopScanMSecs = 15000;
+  static inline const int DirectConnectMSecs = 5000;
+  static inline const int TargetedScanMSecs = 4000;
+  static inline const int WaitBeforeErrorMSecs = 60000;
+  static inline const quint32 GapFactor = 3;
+  static inline const int MaxGapRequests = 8;
+
+  void search(Search method);
+  void connectDirectly(const QString& address);
+  void scan(const QString& pattern);
+  // starts the discovery once the filter is set
+  void setupScan(const QString& pattern);
+  void remember(BluezQt::DevicePtr p);
+  void finish();
+  void connectDevice(BluezQt::DevicePtr);
+  // continues with findDevice when done
+  void disconnectDevice();
+  void updateDB();
+  void requestLog(quint32 then);
+  QVector<QPair<quint32, quint32>> findGaps() const;
+
+  struct Private;
+  Private* const d;
+
+};
@@ -22,67 +22,8 @@
 #include "ruuvireader.h"
 #include <signal.h>
 #include "measurementdatabase.h"
+#include "logger.h"
 #include <QCommandLineParser>
-#include <QFileInfo>
-#include <QDir>
-#include <QMessageLogContext>
-#include <QDateTime>
-#include <QMap>
-
-class Logger {
-public:
-
-  static Logger* instance() {
-    static Logger* logger = new Logger;
-    return logger;
-  }
-
-  Logger() = default;
-
-  QFile* dst() {return m_dest;}
-
-  bool init(const QString& path) {
-    if (path.isEmpty()) return false;
-
-    const QFileInfo info(path);
-    QDir dir("/");
-    if (!dir.mkpath(info.absolutePath())) {
-      qWarning() << "Cannot create" << info.absolutePath();
-      return false;
-    }
-
-    m_dest = new QFile(path);
-    if (!m_dest->open(QFile::WriteOnly | QFile::Append)) {
-      qWarning() << "Cannot open" << path;
-      return false;
-    }
-    return true;
-  }
-
-  static void handler(QtMsgType mt, const QMessageLogContext& ctx, const QString& msg) {
-    const QString formattedTime = QDateTime::currentDateTime().toString("MMM dd hh:mm:ss.zzz");
-    QString txt = QString("[%1] %2: %3 (%4)")
-        .arg(levelNames[mt])
-        .arg(formattedTime)
-        .arg(msg)
-        .arg(ctx.function);
-    QTextStream stream(instance()->dst());
-    stream << txt << "\n";
-  }
-
-private:
-
-  static const inline QMap<QtMsgType, QString> levelNames = {
-    {QtDebugMsg, "D"},
-    {QtInfoMsg, "I"},
-    {QtWarningMsg, "W"},
-    {QtCriticalMsg, "C"},
-    {QtFatalMsg, "F"}
-  };
-
-  QFile* m_dest = nullptr;
-};
-
 
 static int setup_unix_signal_handlers() {
 
@@ -105,13 +46,35 @@ int main(int argc, char *argv[]) {
   QCommandLineParser parser;
   parser.setApplicationDescription("Read the RuuviTag measurement storage to a database");
   parser.addOption({{"l", "logfile"}, "Append log messages to <file>.", "file"});
+  parser.addOption({"log-format", "Log message format: text (default) or json.", "format", "text"});
+  parser.addOption({"log-max-size", "Rotate the log file when it exceeds <bytes>, 0 disables rotation.",
+                    "bytes", QString::number(Logger::DefaultMaxSize)});
+  parser.addOption({"log-keep", "Number of rotated log files to keep.",
+                    "count", QString::number(Logger::DefaultKeep)});
+  parser.addOption({"busy-timeout", "Wait at most <msecs> for a locked database.",
+                    "msecs", QString::number(SQLiteDatabase::Tuning().busyTimeoutMSecs)});
+  parser.addOption({"mmap-size", "Memory map at most <bytes> of the database.",
+                    "bytes", QString::number(SQLiteDatabase::Tuning().mmapSize)});
+  parser.addOption({"cache-size", "Database page cache size in <KiB>.",
+                    "KiB", QString::number(SQLiteDatabase::Tuning().cacheSizeKiB)});
+  parser.addOption({"keep-raw", "Replace measurements older than <days> with averages, 0 keeps all.",
+                    "days", QString::number(RetentionPolicy().keepRawSecs / 86400)});
+  parser.addOption({"aggregate", "Averaging period in <secs> for old measurements.",
+                    "secs", QString::number(RetentionPolicy().aggregateSecs)});
+  parser.addOption({"expire", "Drop measurements older than <months>, 0 keeps all.",
+                    "months", QString::number(RetentionPolicy().expireMonths)});
+  parser.addOption({"log-interval", "Logging interval of the RuuviTags in <secs>, used to detect lost records.",
+                    "secs", QString::number(RuuviReader::DefaultLogInterval)});
   parser.addHelpOption();
   parser.addPositionalArgument("ruuvitags", "Bluetooth addresses of the RuuviTag devices");
   parser.process(app);
 
   const auto logfile = parser.value("logfile");
   if (!logfile.isEmpty()) {
-    if (Logger::instance()->init(logfile)) {
+    const auto format = parser.value("log-format") == "json" ? Logger::Format::Json : Logger::Format::Text;
+    const auto maxSize = parser.value("log-max-size").toLongLong();
+    const auto keep = parser.value("log-keep").toInt();
+    if (Logger::instance()->init(logfile, format, maxSize, keep)) {
       qInstallMessageHandler(Logger::handler);
     } else {
       return 1;
@@ -123,17 +86,34 @@ int main(int argc, char *argv[]) {
     return ret;
   }
 
+  SQLiteDatabase::Tuning tuning;
+  tuning.busyTimeoutMSecs = parser.value("busy-timeout").toInt();
+  tuning.mmapSize = parser.value("mmap-size").toLongLong();
+  tuning.cacheSizeKiB = parser.value("cache-size").toInt();
+  SQLiteDatabase::setTuning(tuning);
+
   try {
     MeasurementDatabase::createTables();
   } catch (const PlatformError& e) {
     qWarning() << e.msg();
+    Logger::instance()->shutdown();
     return 255;
   }
 
   auto reader = new RuuviReader(parser.positionalArguments());
 
-  QObject::connect(reader, &RuuviReader::initialized, reader, &RuuviReader::findDevice);
-  QObject::connect(reader, &RuuviReader::deviceFound, reader, &RuuviReader::readLog);
+  RetentionPolicy retention;
+  retention.keepRawSecs = parser.value("keep-raw").toUInt() * 86400;
+  retention.aggregateSecs = parser.value("aggregate").toUInt();
+  retention.expireMonths = parser.value("expire").toUInt();
+  reader->setRetentionPolicy(retention);
+  reader->setLogInterval(parser.value("log-interval").toUInt());
+
+  QObject::connect(reader, &RuuviReader::initialized, reader, &RuuviReader::start);
+
+  ret = app.exec();
+
+  Logger::instance()->shutdown();
 
-  return app.exec();
+  return ret;
 }
@@ -21,6 +21,10 @@
 
 #include <BluezQt/Manager>
 
+struct RetentionPolicy;
+
+// Distributes the RuuviTags to all powered bluetooth adapters and reads
+// their logs in parallel, one LogSession per adapter.
 class RuuviReader: public QObject {
 
   Q_OBJECT
@@ -31,50 +35,30 @@ public:
   ~RuuviReader();
   static void sigHandler(int sig);
 
+  void setRetentionPolicy(const RetentionPolicy& policy);
+  // Logging interval of the tags, used to find gaps in the log
+  void setLogInterval(quint32 secs);
+
+  static inline const quint32 DefaultLogInterval = 300;
+
 public slots:
 
   void handleSig();
-  void scan();
-  void readLog();
-  void findDevice();
+  void start();
 
 signals:
 
   void initialized();
-  void deviceFound();
-
-private slots:
-
-  void deviceAdded(BluezQt::DevicePtr device);
-  void handleRXNotify(const QByteArray value);
-  void setupNUS(BluezQt::GattServiceRemotePtr srv);
 
 private:
 
-  static inline const int RuuviMID = 1177;
-  static inline const QString NUSUUID = "6E400001-B5A3-F393-E0A9-E50E24DCCA9E";
-  static inline const QString NUSUUID_TX = "6E400002-B5A3-F393-E0A9-E50E24DCCA9E";
-  static inline const QString NUSUUID_RX = "6E400003-B5A3-F393-E0A9-E50E24DCCA9E";
-  static inline const char addr_env = 0x3a;
-  static inline const char addr_temperature = 0x30;
-  static inline const char addr_humidity = 0x31;
-  static inline const char addr_pressure = 0x32;
-  static inline const char op_req = 0x11;
-  static inline const char op_rsp = 0x10;
-  static inline const int StopScanMSecs = 15000;
-  static inline const int WaitBeforeErrorMSecs = 60000;
-
-  static inline const QMap<quint8, QString> tables = {
-    {addr_temperature, "temperature"},
-    {addr_humidity, "humidity"},
-    {addr_pressure, "pressure"}
-  };
-
-  void setupScan();
+  using AdapterList = QList<BluezQt::AdapterPtr>;
+  using Assignment = QMap<QString, QStringList>;
+
+  Assignment assignTags(const AdapterList& adapters) const;
+  void sessionFinished();
+  void checkStale();
   void cleanupAndExit();
-  void connectDevice(BluezQt::DevicePtr);
-  void disconnectDevice();
-  void updateDB();
 
   static inline int m_sigFd[2] = {0, 0};
 
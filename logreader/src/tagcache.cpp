@@ -0,0 +1,103 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./logreader/src/tagcache.cpp
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "tagcache.h"
+
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <QJsonDocument>
+#include <QJsonObject>
+
+TagCache::TagCache() {
+  load();
+}
+
+QString TagCache::fileName() {
+  QString loc = QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation);
+  loc = QString("%1/%2").arg(loc).arg(PROJECT_NAME);
+  if (!QDir().mkpath(loc)) {
+    qWarning() << "Cannot create directory" << loc;
+    return QString();
+  }
+  return QString("%1/tags.json").arg(loc);
+}
+
+bool TagCache::contains(const QString& address) const {
+  return m_entries.contains(address);
+}
+
+TagCache::Entry TagCache::entry(const QString& address) const {
+  return m_entries.value(address);
+}
+
+void TagCache::update(const QString& address, const Entry& e) {
+  m_entries[address] = e;
+  m_modified = true;
+}
+
+void TagCache::load() {
+  m_entries.clear();
+  m_modified = false;
+
+  QFile file(fileName());
+  if (!file.open(QIODevice::ReadOnly)) return;
+
+  const auto doc = QJsonDocument::fromJson(file.readAll());
+  if (!doc.isObject()) {
+    qWarning() << file.fileName() << "is corrupt, ignoring";
+    return;
+  }
+
+  const auto tags = doc.object();
+  for (auto it = tags.constBegin(); it != tags.constEnd(); ++it) {
+    const auto obj = it.value().toObject();
+    Entry e;
+    e.addressType = obj["addressType"].toString();
+    e.adapter = obj["adapter"].toString();
+    e.seen = obj["seen"].toVariant().toUInt();
+    if (e.addressType.isEmpty()) continue;
+    m_entries[it.key()] = e;
+  }
+}
+
+void TagCache::save() const {
+  if (!m_modified) return;
+
+  QJsonObject tags;
+  for (auto it = m_entries.constBegin(); it != m_entries.constEnd(); ++it) {
+    tags[it.key()] = QJsonObject {
+      {"addressType", it.value().addressType},
+      {"adapter", it.value().adapter},
+      {"seen", static_cast<qint64>(it.value().seen)},
+    };
+  }
+
+  QSaveFile file(fileName());
+  if (!file.open(QIODevice::WriteOnly)) {
+    qWarning() << "Cannot write" << file.fileName();
+    return;
+  }
+  file.write(QJsonDocument(tags).toJson(QJsonDocument::Compact));
+  if (!file.commit()) {
+    qWarning() << "Cannot write" << file.fileName();
+  }
+}
@@ -0,0 +1,51 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./logreader/src/tagcache.h
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <QString>
+#include <QHash>
+
+// Remembers how the RuuviTags were reached on earlier runs, so that they
+// can be connected without a discovery after BlueZ has forgotten them.
+class TagCache {
+public:
+
+  struct Entry {
+    QString addressType; // "public" or "random"
+    QString adapter;     // address of the adapter which reached the tag
+    quint32 seen = 0;
+  };
+
+  TagCache();
+
+  bool contains(const QString& address) const;
+  Entry entry(const QString& address) const;
+  void update(const QString& address, const Entry& e);
+
+  void load();
+  void save() const;
+
+private:
+
+  static QString fileName();
+
+  QHash<QString, Entry> m_entries;
+  bool m_modified = false;
+};
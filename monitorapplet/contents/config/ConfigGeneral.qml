@@ -31,6 +31,8 @@ Item {
 
 
   property string cfg_devicesJson
+  property alias cfg_tileCache: tileCache.checked
+  property alias cfg_dewPoint: dewPoint.checked
 
   ListModel {
     id: devicesModel
@@ -170,4 +172,17 @@ Item {
       }
     }
   }
+
+  CheckBox {
+    id: tileCache
+    anchors.top: devicesTable.bottom
+    anchors.topMargin: Core.Units.mediumSpacing
+    text: i18n('Keep rendered charts on disk')
+  }
+
+  CheckBox {
+    id: dewPoint
+    anchors.top: tileCache.bottom
+    text: i18n('Show the dew point')
+  }
 }
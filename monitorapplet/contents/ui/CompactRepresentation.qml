@@ -24,6 +24,7 @@ import org.kde.plasma.extras 2.0 as Extras
 import org.kde.plasma.plasmoid 2.0
 import org.kde.plasma.components 3.0 as Components
 import QtQuick.Layouts 1.2
+import kvanttiapina.kruuvi.private 1.0 as KRuuvi
 
 ListView {
   id: listView
@@ -33,45 +34,6 @@ ListView {
   spacing: 3
 
   property bool vertical: (plasmoid.formFactor === Core.Types.Vertical)
-  property string devicesJson: plasmoid.configuration.devicesJson
-  // property string devicesJson: ''
-  //  Component.onCompleted: {
-  //    devicesJson = '[{"address":"D2:38:63:2A:6F:E1","location":"Asunto","enabled":true},{"address":"E4:80:DB:3E:67:4C","location":"Parveke","enabled":true}]'
-  //  }
-
-  onDevicesJsonChanged: {
-    const devices = JSON.parse(devicesJson)
-    if (devices.length === 0) return
-    const lastValues = JSON.parse(plasmoid.configuration.lastValuesJson)
-    // const lastValues = JSON.parse('[{"name":"Asunto","address":"D2:38:63:2A:6F:E1","temperature":8.27,"humidity":92.96000000000001,"pressure":1008.78},{"name":"Parveke","address":"E4:80:DB:3E:67:4C","temperature":8.27,"humidity":92.96000000000001,"pressure":1008.78}]')
-
-    deviceModel.clear()
-
-    var srcs = []
-
-    devices.forEach(function (item) {
-      if (!item.enabled) return
-      var modelItem = {
-        name: item.location,
-        address: item.address,
-        temperature: NaN,
-        humidity: NaN,
-        pressure: NaN
-      }
-      const d0 = lastValues.find(v => v.name === item.location)
-      if (!!d0) {
-        modelItem.temperature = d0.temperature
-        modelItem.humidity = d0.humidity
-        modelItem.pressure = d0.pressure
-      }
-      deviceModel.append(modelItem)
-      srcs.push(item.address)
-    })
-
-    ruuvi.connectedSources = srcs
-    ruuvi.interval = 10000 // ensure that all sources are updated
-  }
-
 
   orientation: (vertical ? Qt.Vertical : Qt.Horizontal)
 
@@ -80,31 +42,21 @@ ListView {
   Core.DataSource {
     id: ruuvi
     engine: "ruuvimonitor"
+    connectedSources: deviceModel.addresses
+    onConnectedSourcesChanged: interval = 10000 // ensure that all sources are updated
     onNewData: {
-      var lastValuesArray = []
-      for (var i = 0; i < deviceModel.count; i++) {
-        const d = deviceModel.get(i)
-        if (d.address === sourceName) {
-          deviceModel.setProperty(i, "temperature", data.temperature)
-          deviceModel.setProperty(i, "humidity", data.humidity)
-          deviceModel.setProperty(i, "pressure", data.pressure)
-        }
-        lastValuesArray.push
-            ({
-               name: d.name,
-               address: d.address,
-               temperature: d.temperature,
-               humidity: d.humidity,
-               pressure: d.pressure
-             })
+      if (data.temperature === undefined) return
+      deviceModel.setValues(sourceName, data)
+      if (!data.stored) {
+        interval = 0
       }
-      plasmoid.configuration.lastValuesJson = JSON.stringify(lastValuesArray)
-      interval = 0
     }
   }
 
-  model: ListModel {
+  // the engine seeds the values from the measurement database
+  model: KRuuvi.TagModel {
     id: deviceModel
+    devicesJson: plasmoid.configuration.devicesJson
   }
 
   delegate: MeteoDisplay {
@@ -45,15 +45,25 @@ Canvas {
   property real tmin: 0
   property real tdelta: 20
 
-  readonly property real hmin: 20
+  property real hmin: 20
   readonly property real hdelta: ymax * 10
 
-  readonly property real pmin: hmin + 900
+  // pressure is drawn on the right axis above 100 %
+  property real poffset: 900
+  readonly property real pmin: hmin + poffset
   readonly property real pdelta: hdelta
 
+  // Rendered charts by tag, window, size, theme and data version
+  property var tiles: ({})
+  property var tileKeys: []
+  readonly property int maxTiles: 24
+  readonly property bool diskTiles: plasmoid.configuration.tileCache
+  readonly property bool showDewPoint: plasmoid.configuration.dewPoint
+
   readonly property color tcolor: Qt.rgba(1, 0.3, 0.3, 1)
   readonly property color hcolor: Qt.rgba(0.3, 1, 0.3, 1)
   readonly property color pcolor: Qt.rgba(0.3, 0.3, 1, 1)
+  readonly property color dcolor: Qt.rgba(1, 0.7, 0.3, 1)
 
   function valueT(y) {
     return chartTopMargin + (1 - (y - tmin) / tdelta) * chartHeight
@@ -73,6 +83,13 @@ Canvas {
 
   KRuuvi.DBReader {
     id: db
+    onDataChanged: {
+      if (address !== canvas.address) return
+      let start = timeUtils.startInstance()
+      if (to >= start && from <= start + timeUtils.duration()) {
+        canvas.requestPaint()
+      }
+    }
   }
 
 
@@ -92,6 +109,55 @@ Canvas {
     requestPaint()
   }
 
+  onShowDewPointChanged: {
+    requestPaint()
+  }
+
+  onImageLoaded: {
+    requestPaint()
+  }
+
+  function tileKey() {
+    return [address, timeUtils.startInstance(), timeUtils.duration(), width, height,
+            Core.Theme.backgroundColor, showDewPoint,
+            db.dataVersion(address, timeUtils.startInstance(), timeUtils.duration())].join("/")
+  }
+
+  function storeTile(ctx, key) {
+    tiles[key] = ctx.getImageData(0, 0, width, height)
+    tileKeys.push(key)
+    if (tileKeys.length > maxTiles) {
+      delete tiles[tileKeys.shift()]
+    }
+  }
+
+  // Returns true if the chart was drawn from a cached image
+  function drawTile(ctx, key) {
+    const tile = tiles[key]
+    if (tile !== undefined) {
+      ctx.putImageData(tile, 0, 0)
+      return true
+    }
+    if (!diskTiles || !db.tileExists(key)) {
+      return false
+    }
+    const url = "file://" + db.tileFile(key)
+    if (isImageLoaded(url)) {
+      ctx.drawImage(url, 0, 0)
+      storeTile(ctx, key)
+      unloadImage(url)
+      return true
+    }
+    if (isImageError(url)) {
+      return false
+    }
+    if (!isImageLoading(url)) {
+      loadImage(url)
+    }
+    // repainted when loaded
+    return true
+  }
+
   function drawGrid(ctx) {
     ctx.save();
 
@@ -132,6 +198,12 @@ Canvas {
     ctx.fillStyle = tcolor
 
     let limits = db.temperatureLimits(address, timeUtils.startInstance(), timeUtils.duration())
+    if (showDewPoint) {
+      // the dew point shares the temperature axis and is below the temperature
+      let dews = db.dewPoint(address, timeUtils.startInstance(), timeUtils.duration(), sampleCount())
+      let dmin = Math.min.apply(null, dews.filter(v => !isNaN(v)))
+      if (isFinite(dmin)) limits[0] = Math.min(limits[0], dmin)
+    }
     var nmin = Math.floor(limits[0] - .5)
     var nmax = Math.ceil(limits[1] + .5)
     var M = nmax - nmin + 1
@@ -151,13 +223,25 @@ Canvas {
 
     ctx.fillText(rightMetrics.text, canvas.width - units.mediumSpacing, chartTopMargin - units.mediumSpacing)
 
+    let hlimits = db.limits(address, "humidity", timeUtils.startInstance(), timeUtils.duration())
+    hmin = hlimits.length === 2 ? Math.min(20, Math.floor(hlimits[0] / 10) * 10) : 20
+
+    // center the pressure range in the part of the axis above 100 %
+    let plimits = db.limits(address, "pressure", timeUtils.startInstance(), timeUtils.duration())
+    if (plimits.length === 2) {
+      let pmid = (plimits[0] + plimits[1]) / 2
+      poffset = Math.round((pmid - (100 + hmin + hdelta) / 2) / 10) * 10
+    } else {
+      poffset = 900
+    }
+
     ctx.textBaseline = "middle"
     ctx.fillStyle = pcolor
 
     for (i = 0; i <= ymax; i++) {
       var p = hmin + (ymax - i) * 10
       if (p >= 100) {
-        p += 900
+        p += poffset
       } else {
         ctx.fillStyle = hcolor
       }
@@ -184,13 +268,17 @@ Canvas {
     ctx.restore()
   }
 
+  function sampleCount() {
+    return Math.ceil(timeUtils.duration() * timeUtils.sampleFrequency())
+  }
+
   function drawValues(ctx, func, fetcher, col) {
     ctx.save();
 
     ctx.strokeStyle = col;
     ctx.beginPath();
 
-    let nump = Math.ceil(timeUtils.duration() * timeUtils.sampleFrequency())
+    let nump = sampleCount()
     var needToMove = true
     let values = fetcher(address, timeUtils.startInstance(), timeUtils.duration(), nump)
 
@@ -217,12 +305,23 @@ Canvas {
 
   onPaint: {
     var ctx = canvas.getContext("2d");
+    const key = tileKey()
+    if (drawTile(ctx, key)) return
+
     ctx.lineWidth = 1;
     drawGrid(ctx);
     drawUnits(ctx)
     drawValues(ctx, valueT, db.temperature, tcolor)
     drawValues(ctx, valueP, db.pressure, pcolor)
     drawValues(ctx, valueH, db.humidity, hcolor)
+    if (showDewPoint) {
+      drawValues(ctx, valueT, db.dewPoint, dcolor)
+    }
+
+    storeTile(ctx, key)
+    if (diskTiles) {
+      save(db.tileFile(key))
+    }
   }
 }
 
@@ -0,0 +1,63 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./replay/src/latencyprobe.cpp
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "latencyprobe.h"
+
+#include <QDateTime>
+#include <QDebug>
+#include <QTimer>
+#include <algorithm>
+
+LatencyProbe::LatencyProbe(QObject* parent)
+  : QObject(parent)
+  , m_idle(new QTimer(this)) {
+  m_idle->setSingleShot(true);
+  m_idle->setInterval(IdleMSecs);
+  connect(m_idle, &QTimer::timeout, this, &LatencyProbe::done);
+  m_idle->start();
+}
+
+void LatencyProbe::dataUpdated(const QString&, const Plasma::DataEngine::Data& data) {
+  // the stored values seeded from the database have no latency
+  if (!data.contains("received") || data.value("stored").toBool()) return;
+  if (m_latencies.isEmpty()) {
+    m_elapsed.start();
+  }
+  m_latencies << QDateTime::currentMSecsSinceEpoch() - data.value("received").toLongLong();
+  m_idle->start();
+}
+
+void LatencyProbe::report() const {
+  if (m_latencies.isEmpty()) {
+    qInfo() << "No updates from the data engine";
+    return;
+  }
+  auto sorted = m_latencies;
+  std::sort(sorted.begin(), sorted.end());
+  const auto at = [&sorted] (double p) {
+    return sorted[std::min<int>(sorted.size() - 1, p * sorted.size())];
+  };
+  const qint64 msecs = std::max<qint64>(1, m_elapsed.elapsed() - IdleMSecs);
+  qInfo().noquote() << QString("%1 updates, %2 updates/s, latency p50 %3 ms, p95 %4 ms, max %5 ms")
+                       .arg(sorted.size())
+                       .arg(sorted.size() * 1000. / msecs, 0, 'f', 0)
+                       .arg(at(.5))
+                       .arg(at(.95))
+                       .arg(sorted.last());
+}
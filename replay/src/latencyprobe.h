@@ -0,0 +1,56 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./replay/src/latencyprobe.h
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <Plasma/DataEngine>
+#include <QElapsedTimer>
+#include <QVector>
+
+class QTimer;
+
+// Collects the delay from the advertisement decoding in the data engine
+// to the delivery of the update. Emits done when no updates have arrived
+// for IdleMSecs.
+class LatencyProbe: public QObject {
+
+  Q_OBJECT
+
+public:
+
+  LatencyProbe(QObject* parent = nullptr);
+
+  void report() const;
+
+  static inline const int IdleMSecs = 3000;
+
+public slots:
+
+  void dataUpdated(const QString& source, const Plasma::DataEngine::Data& data);
+
+signals:
+
+  void done();
+
+private:
+
+  QTimer* m_idle;
+  QElapsedTimer m_elapsed;
+  QVector<qint64> m_latencies;
+};
@@ -0,0 +1,143 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./replay/src/main.cpp
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QSet>
+#include <Plasma/DataEngineConsumer>
+#include "advertisementsource.h"
+#include "dataformat5.h"
+#include "sqlitedatabase.h"
+#include "latencyprobe.h"
+
+// Decodes the advertisements of the source and reports the rate when it finishes
+static void benchmarkDecoder(ReplaySource* source) {
+  int decoded = 0;
+  int invalid = 0;
+  QElapsedTimer timer;
+  QObject::connect(source, &AdvertisementSource::received, [&] (const Advertisement& ad) {
+    Reading reading;
+    if (DataFormat5::decode(ad.data, reading)) {
+      decoded++;
+    } else {
+      invalid++;
+    }
+  });
+  QObject::connect(source, &AdvertisementSource::finished, [&] () {
+    const qint64 nsecs = std::max<qint64>(1, timer.nsecsElapsed());
+    qInfo().noquote() << QString("%1 advertisements decoded, %2 invalid, %3 advertisements/s")
+                         .arg(decoded)
+                         .arg(invalid)
+                         .arg(decoded * 1e9 / nsecs, 0, 'f', 0);
+    QCoreApplication::quit();
+  });
+  timer.start();
+  source->start();
+  QCoreApplication::exec();
+
+  // the same payloads decoded in one call, without the signal per advertisement
+  QVector<QByteArray> payloads;
+  payloads.reserve(source->advertisements().size());
+  for (const Advertisement& ad: source->advertisements()) {
+    payloads << ad.data;
+  }
+  Readings readings;
+  timer.start();
+  const int n = DataFormat5::decode(payloads, readings);
+  const qint64 nsecs = std::max<qint64>(1, timer.nsecsElapsed());
+  qInfo().noquote() << QString("batch: %1 advertisements decoded, %2 advertisements/s")
+                       .arg(n)
+                       .arg(n * 1e9 / nsecs, 0, 'f', 0);
+}
+
+// The data engine replays the capture itself, the probe measures the
+// delay until its updates reach a consumer
+static void benchmarkEngine(const QString& path, bool realtime, const QVector<Advertisement>& ads) {
+  qputenv("KRUUVI_REPLAY", QFile::encodeName(path));
+  qputenv("KRUUVI_REPLAY_SPEED", realtime ? "realtime" : "max");
+
+  Plasma::DataEngineConsumer consumer;
+  auto engine = consumer.dataEngine("ruuvimonitor");
+  if (!engine->isValid()) {
+    qWarning() << "Cannot load the ruuvimonitor data engine";
+    return;
+  }
+
+  LatencyProbe probe;
+  QSet<QString> addresses;
+  for (const Advertisement& ad: ads) {
+    addresses << ad.address;
+  }
+  for (const auto& address: addresses) {
+    engine->connectSource(address, &probe);
+  }
+  QObject::connect(&probe, &LatencyProbe::done, [&probe] () {
+    probe.report();
+    QCoreApplication::quit();
+  });
+  QCoreApplication::exec();
+}
+
+int main(int argc, char *argv[]) {
+  QCoreApplication app(argc, argv);
+
+  QCommandLineParser parser;
+  parser.setApplicationDescription("Replay recorded RuuviTag advertisements and benchmark their handling");
+  parser.addOption({"realtime", "Replay at the recorded pace instead of the maximum speed."});
+  parser.addOption({"engine", "Measure the update latency of the ruuvimonitor data engine."});
+  parser.addOption({"save", "Write the advertisements of the capture as text to <file> and exit.", "file"});
+  parser.addHelpOption();
+  parser.addPositionalArgument("capture", "btsnoop or pcap capture or a text recording");
+  parser.process(app);
+
+  if (parser.positionalArguments().size() != 1) {
+    parser.showHelp(1);
+  }
+  const auto path = parser.positionalArguments().first();
+  const bool realtime = parser.isSet("realtime");
+
+  try {
+    ReplaySource source(path, realtime ? ReplaySource::Speed::RealTime : ReplaySource::Speed::Maximum);
+    qInfo() << source.advertisements().size() << "advertisements in" << path;
+
+    if (parser.isSet("save")) {
+      QFile out(parser.value("save"));
+      if (!out.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qWarning() << "Cannot open" << out.fileName();
+        return 1;
+      }
+      ReplaySource::write(source.advertisements(), &out);
+      return 0;
+    }
+
+    if (parser.isSet("engine")) {
+      benchmarkEngine(path, realtime, source.advertisements());
+    } else {
+      benchmarkDecoder(&source);
+    }
+  } catch (const PlatformError& e) {
+    qWarning() << e.msg();
+    return 1;
+  }
+
+  return 0;
+}
@@ -19,103 +19,355 @@
  */
 #include "dbreader.h"
 #include "measurementdatabase.h"
+#include "statsindex.h"
+#include "resample.h"
+#include "derived.h"
+#include "changenotifier.h"
+#include "historyclient.h"
 #include <QVariant>
 #include <QDebug>
+#include <QDir>
+#include <QDateTime>
+#include <QFileInfo>
+#include <QCryptographicHash>
+#include <QStandardPaths>
 
 DBReader::DBReader(QObject* parent)
-  : QObject(parent) {}
+  : QObject(parent)
+  , m_stats(new StatsIndex("DBReader::stats"))
+  , m_history(new HistoryClient)
+  , m_derived(maxDerivedCost) {
+  auto listener = new ChangeListener(this);
+  connect(listener, &ChangeListener::changed, this, [this] (const QString& addr, const QString& metric,
+                                                           quint32 from, quint32 to) {
+    m_stats->invalidate(addr, metric, from, to);
+    const auto prefix = addr + '/';
+    for (auto it = m_versions.begin(); it != m_versions.end();) {
+      it = it.key().startsWith(prefix) ? m_versions.erase(it) : it + 1;
+    }
+    for (const auto& key: m_derived.keys()) {
+      if (key.startsWith(prefix)) {
+        m_derived.remove(key);
+      }
+    }
+  });
+  connect(listener, &ChangeListener::changed, this, &DBReader::dataChanged);
+  pruneTiles();
+}
 
-DBReader::~DBReader() {}
+DBReader::~DBReader() {
+  delete m_stats;
+  delete m_history;
+}
 
 QVariantList DBReader::addresses() {
-  MeasurementDatabase db("DBReader::addresses");
-
-  const auto as = db.addresses();
   QVariantList aps;
-  for (const auto& a: as) {
-    aps << a;
+  try {
+    MeasurementDatabase db("DBReader::addresses", MeasurementDatabase::Mode::ReadOnly);
+
+    const auto as = db.addresses();
+    for (const auto& a: as) {
+      aps << a;
+    }
+  } catch (const DatabaseError& e) {
+    qWarning() << "DBReader::addresses:" << e.msg();
   }
   return aps;
 }
 
 
 QVariantList DBReader::temperature(const QString& addr, quint32 start, quint32 duration, quint16 samples) {
-  return fetchData(addr, start, start + duration, samples, "temperature");
+  return fetchData(addr, start, start + duration, samples, MetricId::Temperature);
 }
 
 QVariantList DBReader::humidity(const QString& addr, quint32 start, quint32 duration, quint16 samples) {
-  return fetchData(addr, start, start + duration, samples, "humidity");
+  return fetchData(addr, start, start + duration, samples, MetricId::Humidity);
 }
 
 QVariantList DBReader::pressure(const QString& addr, quint32 start, quint32 duration, quint16 samples) {
-  return fetchData(addr, start, start + duration, samples, "pressure");
+  return fetchData(addr, start, start + duration, samples, MetricId::Pressure);
 }
 
 
-QVariantList DBReader::fetchData(const QString& addr, quint32 start, quint32 end, quint16 samples, const QString& table) {
-  MeasurementDatabase db("DBReader::fetch");
+QVariantList DBReader::dewPoint(const QString& addr, quint32 start, quint32 duration, quint16 samples) {
+  return fetchDerived(QStringList {addr}, start, start + duration, samples, DerivedId::DewPoint).value(addr);
+}
 
-  MeasurementVector values = db.measurements(db.locationId(addr), table, start - 3600, end + 3600);
-  QVariantList results;
+QVariantList DBReader::absoluteHumidity(const QString& addr, quint32 start, quint32 duration, quint16 samples) {
+  return fetchDerived(QStringList {addr}, start, start + duration, samples, DerivedId::AbsoluteHumidity).value(addr);
+}
 
-  // qDebug() << "fetched" << values.size() << "values";
+QVariantList DBReader::pressureTendency(const QString& addr, quint32 start, quint32 duration, quint16 samples) {
+  return fetchDerived(QStringList {addr}, start, start + duration, samples, DerivedId::PressureTendency).value(addr);
+}
 
-  const double D = end - start;
+QVariantList DBReader::fetchData(const QString& addr, quint32 start, quint32 end, quint16 samples, MetricId metric) {
+  return fetchSeries(QStringList {addr}, start, end, samples, metric).value(addr);
+}
 
-  if (!values.isEmpty()) {
-    double s = start + results.size() * D / samples;
-    while (s < values.first().ts && results.size() < samples) {
-      results << undefined;
-      s = start + results.size() * D / samples;
-    }
+QVariantMap DBReader::series(const QStringList& addrs, const QString& metric,
+                             quint32 start, quint32 duration, quint16 samples) {
+  QVariantMap results;
+  QHash<QString, QVariantList> series;
+  if (const Metric* m = Metrics::fromName(metric)) {
+    series = fetchSeries(addrs, start, start + duration, samples, m->id);
+  } else if (const DerivedMetric* dm = DerivedMetrics::fromName(metric)) {
+    series = fetchDerived(addrs, start, start + duration, samples, dm->id);
+  } else {
+    qWarning() << "DBReader::series: unknown metric" << metric;
+    return results;
+  }
+
+  for (auto it = series.cbegin(); it != series.cend(); ++it) {
+    results[it.key()] = it.value();
+  }
+  return results;
+}
 
-    quint16 i = 0;
-    while (results.size() < samples) {
-      const double s = start + results.size() * D / samples;
-      while (i < values.size() && values[i].ts <= s) i++;
-      if (i >= values.size()) break;
-      const double ds = values[i].ts - values[i - 1].ts;
-      if (ds > largeGap) {
-        results << undefined;
-      } else {
-        const double s0 = values[i - 1].ts;
-        const double s1 = values[i].ts;
-        const double v0 = values[i - 1].value;
-        const double v1 = values[i].value;
-
-        results << (s - s0) / ds * v1 + (s1 - s) / ds * v0;
+QHash<QString, QVariantList> DBReader::fetchSeries(const QStringList& addrs, quint32 start, quint32 end,
+                                                   quint16 samples, MetricId metric) {
+  QHash<QString, QVariantList> results;
+  if (m_history->available()) {
+    try {
+      const auto served = m_history->resample(addrs, metric, start, end, samples, largeGap);
+      for (const auto& addr: addrs) {
+        results[addr] = toList(served.value(addr));
       }
-      i--;
+      return results;
+    } catch (const PlatformError& e) {
+      qWarning() << "DBReader::fetchSeries:" << e.msg();
+    } catch (const DatabaseError& e) {
+      qWarning() << "DBReader::fetchSeries:" << e.msg();
     }
   }
 
-  while (results.size() < samples) {
-    results << undefined;
+  SeriesMap values;
+  QHash<QString, quint32> ids;
+  try {
+    QVector<quint32> locIds;
+    for (const auto& addr: addrs) {
+      const auto locId = locationId(addr);
+      if (locId == 0) continue;
+      ids[addr] = locId;
+      locIds << locId;
+    }
+    MeasurementDatabase db("DBReader::fetch", MeasurementDatabase::Mode::ReadOnly);
+    values = db.measurements(locIds, metric, start - margin, end + margin);
+  } catch (const DatabaseError& e) {
+    qWarning() << "DBReader::fetchSeries:" << e.msg();
   }
 
+  // qDebug() << "fetched" << values.size() << "series";
+
+  for (const auto& addr: addrs) {
+    results[addr] = toList(resample(values.value(ids.value(addr)), start, end, samples, largeGap));
+  }
   return results;
 }
 
+QHash<QString, QVariantList> DBReader::fetchDerived(const QStringList& addrs, quint32 start, quint32 end,
+                                                    quint16 samples, DerivedId id) {
+  const auto cacheKey = [=] (const QString& addr) {
+    return QString("%1/%2/%3/%4/%5").arg(addr).arg(static_cast<int>(id)).arg(start).arg(end).arg(samples);
+  };
+
+  QHash<QString, QVariantList> results;
+  QStringList missing;
+  for (const auto& addr: addrs) {
+    if (const auto cached = m_derived.object(cacheKey(addr))) {
+      results[addr] = toList(*cached);
+    } else {
+      missing << addr;
+    }
+  }
+  if (missing.isEmpty()) return results;
+
+  const auto& metric = DerivedMetrics::get(id);
+  std::array<SeriesMap, Metrics::count> inputs;
+  QHash<QString, quint32> ids;
+  bool ok = true;
+  try {
+    QVector<quint32> locIds;
+    for (const auto& addr: missing) {
+      const auto locId = locationId(addr);
+      if (locId == 0) continue;
+      ids[addr] = locId;
+      locIds << locId;
+    }
+    MeasurementDatabase db("DBReader::derived", MeasurementDatabase::Mode::ReadOnly);
+    for (const Metric& m: Metrics::all) {
+      if (!metric.inputs[static_cast<int>(m.id)]) continue;
+      inputs[static_cast<int>(m.id)] = db.measurements(locIds, m.id, start - metric.lookback - margin, end + margin);
+    }
+  } catch (const DatabaseError& e) {
+    qWarning() << "DBReader::fetchDerived:" << e.msg();
+    ok = false;
+  }
+
+  for (const auto& addr: missing) {
+    MetricSeries series;
+    for (int k = 0; k < Metrics::count; k++) {
+      series[k] = inputs[k].value(ids.value(addr));
+    }
+    const auto values = derive(id, series, start, end, samples, largeGap);
+    if (ok && ids.contains(addr)) {
+      m_derived.insert(cacheKey(addr), new QVector<double>(values), samples);
+    }
+    results[addr] = toList(values);
+  }
+  return results;
+}
+
+QVariantList DBReader::toList(const QVector<double>& values) {
+  QVariantList r;
+  r.reserve(values.size());
+  for (const double v: values) {
+    r << v;
+  }
+  return r;
+}
+
 
 QVariantList DBReader::temperatureLimits(const QString& addr, quint32 start, quint32 duration) {
-  MeasurementDatabase db("DBReader::limits");
+  const auto results = limits(addr, "temperature", start, duration);
+  if (results.isEmpty()) {
+    return QVariantList {-5.0d, 25.0d};
+  }
+  return results;
+}
 
-  QVariantList results {-5.0d, 25.0d};
+quint32 DBReader::locationId(const QString& addr) {
+  const auto it = m_locations.constFind(addr);
+  if (it != m_locations.constEnd()) {
+    return it.value();
+  }
 
-  MeasurementVector values = db.measurements(db.locationId(addr), "temperature", start, start + duration);
-  // qDebug() << "fetched" << values.size() << "values";
+  MeasurementDatabase db("DBReader::location", MeasurementDatabase::Mode::ReadOnly);
+  const auto locId = db.locationId(addr);
+  if (locId != 0) {
+    m_locations[addr] = locId;
+  }
+  return locId;
+}
 
-  if (values.isEmpty()) return results;
+QVariantList DBReader::limits(const QString& addr, const QString& metric, quint32 start, quint32 duration) {
+  QVariantList results;
+  const Metric* m = Metrics::fromName(metric);
+  if (m == nullptr) {
+    qWarning() << "DBReader::limits: unknown metric" << metric;
+    return results;
+  }
 
-  double tmin = 100;
-  double tmax = -100;
+  QVector<float> unused;
+  const auto s = fetchStats(addr, m->id, start, start + duration, {}, unused);
+  if (s.count > 0) {
+    results << s.min << s.max;
+  }
+  return results;
+}
 
-  for (const Measurement& v: values) {
-    if (v.value < tmin) tmin = v.value;
-    if (v.value > tmax) tmax = v.value;
+QVariantMap DBReader::stats(const QString& addr, const QString& metric, quint32 start, quint32 duration) {
+  QVariantMap results;
+  const Metric* m = Metrics::fromName(metric);
+  if (m == nullptr) {
+    qWarning() << "DBReader::stats: unknown metric" << metric;
+    return results;
   }
 
-  results[0] = tmin;
-  results[1] = tmax;
+  QVector<float> ps;
+  const auto s = fetchStats(addr, m->id, start, start + duration, {.05, .5, .95}, ps);
+  results["count"] = s.count;
+  if (s.count > 0) {
+    results["min"] = s.min;
+    results["max"] = s.max;
+    results["mean"] = s.mean;
+    results["p5"] = ps.value(0);
+    results["p50"] = ps.value(1);
+    results["p95"] = ps.value(2);
+  }
   return results;
 }
+
+// The history service keeps a warm index, ask it first
+Stats DBReader::fetchStats(const QString& addr, MetricId metric, quint32 start, quint32 end,
+                           const QVector<double>& ps, QVector<float>& percentiles) {
+  if (m_history->available()) {
+    try {
+      return m_history->stats(addr, metric, start, end, ps, percentiles);
+    } catch (const PlatformError& e) {
+      qWarning() << "DBReader::fetchStats:" << e.msg();
+    } catch (const DatabaseError& e) {
+      qWarning() << "DBReader::fetchStats:" << e.msg();
+    }
+  }
+
+  Stats s;
+  percentiles.clear();
+  try {
+    const auto locId = locationId(addr);
+    if (locId == 0) return s;
+    s = m_stats->stats(locId, metric, start, end);
+    for (const double p: ps) {
+      percentiles << m_stats->percentile(locId, metric, start, end, p);
+    }
+  } catch (const DatabaseError& e) {
+    qWarning() << "DBReader::fetchStats:" << e.msg();
+  }
+  return s;
+}
+
+QString DBReader::dataVersion(const QString& addr, quint32 start, quint32 duration) {
+  // everything a chart of the window reads
+  quint32 lookback = 0;
+  for (const DerivedMetric& m: DerivedMetrics::all) {
+    lookback = std::max(lookback, m.lookback);
+  }
+  const quint32 from = start > lookback + margin ? start - lookback - margin : 0;
+  const quint32 to = start + duration + margin;
+
+  const auto key = QString("%1/%2/%3").arg(addr).arg(from).arg(to);
+  auto it = m_versions.find(key);
+  if (it == m_versions.end()) {
+    qint64 v = 0;
+    try {
+      const auto locId = locationId(addr);
+      if (locId != 0) {
+        MeasurementDatabase db("DBReader::version", MeasurementDatabase::Mode::ReadOnly);
+        v = db.dataVersion(locId, from, to);
+      }
+    } catch (const DatabaseError& e) {
+      qWarning() << "DBReader::dataVersion:" << e.msg();
+    }
+    if (m_versions.size() >= maxVersions) {
+      m_versions.clear();
+    }
+    it = m_versions.insert(key, v);
+  }
+  return QString::number(it.value());
+}
+
+QString DBReader::tileDirectory() {
+  QString loc = QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation);
+  return QString("%1/%2/tiles").arg(loc).arg(PROJECT_NAME);
+}
+
+QString DBReader::tileFile(const QString& key) const {
+  const auto dir = tileDirectory();
+  QDir().mkpath(dir);
+  const auto hash = QCryptographicHash::hash(key.toUtf8(), QCryptographicHash::Sha1).toHex();
+  return QString("%1/%2.png").arg(dir).arg(QString::fromLatin1(hash));
+}
+
+bool DBReader::tileExists(const QString& key) const {
+  return QFileInfo::exists(tileFile(key));
+}
+
+void DBReader::pruneTiles() const {
+  const auto oldest = QDateTime::currentDateTime().addSecs(-maxTileAge);
+  QDir dir(tileDirectory());
+  for (const auto& info: dir.entryInfoList({"*.png"}, QDir::Files)) {
+    if (info.lastModified() < oldest) {
+      QFile::remove(info.absoluteFilePath());
+    }
+  }
+}
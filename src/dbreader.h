@@ -20,7 +20,14 @@
 #pragma once
 
 #include <QObject>
-#include <limits>
+#include <QHash>
+#include <QCache>
+#include "metrics.h"
+
+class StatsIndex;
+class HistoryClient;
+struct Stats;
+enum class DerivedId: quint8;
 
 class DBReader: public QObject {
 
@@ -35,14 +42,66 @@ public:
   Q_INVOKABLE QVariantList temperature(const QString& addr, quint32 start, quint32 duration, quint16 samples);
   Q_INVOKABLE QVariantList humidity(const QString& addr, quint32 start, quint32 duration, quint16 samples);
   Q_INVOKABLE QVariantList pressure(const QString& addr, quint32 start, quint32 duration, quint16 samples);
+  Q_INVOKABLE QVariantList dewPoint(const QString& addr, quint32 start, quint32 duration, quint16 samples);
+  Q_INVOKABLE QVariantList absoluteHumidity(const QString& addr, quint32 start, quint32 duration, quint16 samples);
+  // Change over the preceding three hours
+  Q_INVOKABLE QVariantList pressureTendency(const QString& addr, quint32 start, quint32 duration, quint16 samples);
 
   Q_INVOKABLE QVariantList temperatureLimits(const QString& addr, quint32 start, quint32 duration);
+  // [min, max] of the metric in the window, empty if there are no measurements
+  Q_INVOKABLE QVariantList limits(const QString& addr, const QString& metric, quint32 start, quint32 duration);
+  // Resamples the metric of all the tags to the same time grid with one
+  // range scan. Returns the sample lists by address. Derived metrics
+  // (dewpoint, absolutehumidity, pressuretendency) are accepted too.
+  Q_INVOKABLE QVariantMap series(const QStringList& addrs, const QString& metric,
+                                 quint32 start, quint32 duration, quint16 samples);
+  // count, min, max, mean and the 5th, 50th and 95th percentiles
+  Q_INVOKABLE QVariantMap stats(const QString& addr, const QString& metric, quint32 start, quint32 duration);
+
+  // Changes whenever the measurements of the tag read for the window
+  // change, also across restarts. Only the first call per tag and window
+  // reads the database.
+  Q_INVOKABLE QString dataVersion(const QString& addr, quint32 start, quint32 duration);
+  // Path of the on-disk chart image for the key, in the cache directory
+  Q_INVOKABLE QString tileFile(const QString& key) const;
+  Q_INVOKABLE bool tileExists(const QString& key) const;
+
+signals:
+
+  // New or changed measurements of the tag in [from, to]
+  void dataChanged(const QString& address, const QString& metric, quint32 from, quint32 to);
 
 private:
 
-  QVariantList fetchData(const QString& addr, quint32 start, quint32 end, quint16 samples, const QString& table);
+  quint32 locationId(const QString& addr);
+  static QString tileDirectory();
+  void pruneTiles() const;
+
+  QVariantList fetchData(const QString& addr, quint32 start, quint32 end, quint16 samples, MetricId metric);
+  QHash<QString, QVariantList> fetchSeries(const QStringList& addrs, quint32 start, quint32 end,
+                                           quint16 samples, MetricId metric);
+  QHash<QString, QVariantList> fetchDerived(const QStringList& addrs, quint32 start, quint32 end,
+                                            quint16 samples, DerivedId id);
+  Stats fetchStats(const QString& addr, MetricId metric, quint32 start, quint32 end,
+                   const QVector<double>& ps, QVector<float>& percentiles);
+  static QVariantList toList(const QVector<double>& values);
+
+  static const inline quint32 largeGap = 5 * 3600;
+  // extra data around the window for the interpolation
+  static const inline quint32 margin = 3600;
+  static const inline qint64 maxTileAge = 30 * 24 * 3600;
+  // samples of the cached derived series
+  static const inline int maxDerivedCost = 256 * 1024;
+  static const inline int maxVersions = 256;
 
-  static const inline double undefined = std::numeric_limits<double>::quiet_NaN();
-  static const inline double largeGap = 5 * 3600;
+  StatsIndex* const m_stats;
+  // kruuvi_historyd if it is running, the database otherwise
+  HistoryClient* const m_history;
+  // Location ids never change, unknown addresses are not cached
+  QHash<QString, quint32> m_locations;
+  // By address and time range
+  QHash<QString, qint64> m_versions;
+  // By address, derived metric and window, dropped when the tag data changes
+  QCache<QString, QVector<double>> m_derived;
 
 };
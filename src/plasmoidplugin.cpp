@@ -19,10 +19,12 @@
  */
 #include "plasmoidplugin.h"
 #include "dbreader.h"
+#include "tagmodel.h"
 
 #include <QtQml>
 
 void PlasmoidPlugin::registerTypes(const char* uri) {
   Q_ASSERT(uri == QLatin1String("kvanttiapina.kruuvi.private"));
   qmlRegisterType<DBReader>(uri, 1, 0, "DBReader");
+  qmlRegisterType<TagModel>(uri, 1, 0, "TagModel");
 }
@@ -23,8 +23,12 @@
 #include <QDebug>
 #include <KPluginFactory>
 #include <BluezQt/InitManagerJob>
-#include <QDataStream>
+#include <QDateTime>
 #include <cmath>
+#include "measurementdatabase.h"
+#include "dataformat5.h"
+#include "advertisementsource.h"
+#include "alerts.h"
 
 using DeviceMap = QMap<QString, BluezQt::DevicePtr>;
 using BoolMap = QMap<QString, bool>;
@@ -35,6 +39,12 @@ struct RuuviEngine::Private {
   BoolMap m_updated;
   QTimer* m_deviceSearchTimer = nullptr;
   QTimer* m_refreshTimer = nullptr;
+  AdvertisementSource* m_source = nullptr;
+  QTimer* m_staleTimer = nullptr;
+  // Live readings are evaluated in memory starting from the state stored
+  // by the log reader, which keeps the event table
+  AlertEngine m_alerts;
+  QHash<QString, quint32> m_lastSeen;
 };
 
 
@@ -66,8 +76,56 @@ RuuviEngine::RuuviEngine(QObject* parent, const QVariantList& args)
 
   d->m_refreshTimer->start();
 
+  if (!d->m_alerts.isEmpty()) {
+    d->m_staleTimer = new QTimer(this);
+    d->m_staleTimer->setInterval(StaleCheckMSecs);
+    connect(d->m_staleTimer, &QTimer::timeout, this, [this] () {
+      const quint32 now = QDateTime::currentSecsSinceEpoch();
+      for (auto it = d->m_lastSeen.cbegin(); it != d->m_lastSeen.cend(); ++it) {
+        for (const AlertEvent& e: d->m_alerts.checkStale(it.key(), it.value(), now)) {
+          e.notify();
+        }
+      }
+    });
+    d->m_staleTimer->start();
+  }
+
   d->m_manager = new BluezQt::Manager(this);
 
+  connect(this, &RuuviEngine::sourceRemoved, this, [this] (const QString& addr) {
+    if (d->m_tags.contains(addr)) {
+      qDebug() << "Removing Dataengine source" << addr;
+      if (d->m_tags[addr] != nullptr) {
+        disconnect(d->m_tags[addr].data(), nullptr, this, nullptr);
+      }
+      d->m_tags.remove(addr);
+      d->m_updated.remove(addr);
+      d->m_lastSeen.remove(addr);
+    }
+  });
+
+  // Recorded advertisements instead of bluetooth, for benchmarks
+  const auto replay = qEnvironmentVariable("KRUUVI_REPLAY");
+  if (!replay.isEmpty()) {
+    const auto speed = qEnvironmentVariable("KRUUVI_REPLAY_SPEED") == "max" ?
+          ReplaySource::Speed::Maximum : ReplaySource::Speed::RealTime;
+    try {
+      d->m_source = new ReplaySource(replay, speed, this);
+    } catch (const PlatformError& e) {
+      qWarning() << "RuuviEngine:" << e.msg();
+    }
+  }
+  if (d->m_source != nullptr) {
+    d->m_refreshTimer->stop();
+    connect(d->m_source, &AdvertisementSource::received, this, [this] (const Advertisement& ad) {
+      if (d->m_tags.contains(ad.address)) {
+        setDataFromPayload(ad.address, ad.data);
+      }
+    });
+    QTimer::singleShot(0, d->m_source, &AdvertisementSource::start);
+    return;
+  }
+
   connect(d->m_manager, &BluezQt::Manager::deviceAdded, this, &RuuviEngine::deviceAdded);
   connect(d->m_manager, &BluezQt::Manager::deviceRemoved, this, &RuuviEngine::deviceRemoved);
 
@@ -84,17 +142,6 @@ RuuviEngine::RuuviEngine(QObject* parent, const QVariantList& args)
       emit initialized();
     }
   });
-
-  connect(this, &RuuviEngine::sourceRemoved, this, [this] (const QString& addr) {
-    if (d->m_tags.contains(addr)) {
-      qDebug() << "Removing Dataengine source" << addr;
-      if (d->m_tags[addr] != nullptr) {
-        disconnect(d->m_tags[addr].data(), nullptr, this, nullptr);
-      }
-      d->m_tags.remove(addr);
-      d->m_updated.remove(addr);
-    }
-  });
 }
 
 void RuuviEngine::stopScanning() {
@@ -184,36 +231,40 @@ void RuuviEngine::deviceRemoved(BluezQt::DevicePtr p) {
 
 RuuviEngine::~RuuviEngine() {}
 
-template<typename T> T read_value(QDataStream& stream) {
-  T value;
-  stream >> value;
-  return value;
-}
-
 bool RuuviEngine::setDataFromManufacturerData(const QString& name) {
   const auto data = d->m_tags[name]->manufacturerData();
-  if (!data.contains(RuuviMID)) {
+  return setDataFromPayload(name, data.value(DataFormat5::ManufacturerId));
+}
+
+bool RuuviEngine::setDataFromPayload(const QString& name, const QByteArray& payload) {
+  Reading reading;
+  if (!DataFormat5::decode(payload, reading)) {
     setData(name, DataEngine::Data());
     return false;
   }
 
-  QDataStream stream(data[RuuviMID]);
-  stream.setByteOrder(QDataStream::BigEndian);
-
-  stream.skipRawData(1);
-
-  const qreal T = read_value<qint16>(stream) * .005;
-  const qreal H = read_value<quint16>(stream) * .0025;
-  const qreal P = (read_value<quint16>(stream) + 50000) * .01;
-
   DataEngine::Data values;
-  values["temperature"] = T;
-  values["humidity"] = H;
-  values["pressure"] = P;
+  for (const Metric& metric: Metrics::all) {
+    values[metric.storageName()] = reading[static_cast<int>(metric.id)];
+  }
+  values["received"] = QDateTime::currentMSecsSinceEpoch();
+  values["timestamp"] = values["received"].toLongLong() / 1000;
+  values["stored"] = false;
 
-  qDebug() << "setData" << T << H << P;
+  qDebug() << "setData" << reading[0] << reading[1] << reading[2];
   setData(name, values);
 
+  if (!d->m_alerts.isEmpty()) {
+    const quint32 ts = values["timestamp"].toUInt();
+    d->m_lastSeen[name] = ts;
+    for (const Metric& metric: Metrics::all) {
+      const MeasurementVector sample {Measurement(ts, reading[static_cast<int>(metric.id)])};
+      for (const AlertEvent& e: d->m_alerts.evaluate(name, metric.id, sample)) {
+        e.notify();
+      }
+    }
+  }
+
   d->m_updated[name] = true;
   if (allUpdated()) {
     qDebug() << "All updated";
@@ -223,11 +274,56 @@ bool RuuviEngine::setDataFromManufacturerData(const QString& name) {
   return true;
 }
 
+void RuuviEngine::loadAlertState(const QString& name) {
+  if (d->m_alerts.isEmpty()) return;
+  try {
+    MeasurementDatabase db("RuuviEngine::loadAlertState", MeasurementDatabase::Mode::ReadOnly);
+    d->m_alerts.loadState(db, name);
+  } catch (const DatabaseError& e) {
+    qWarning() << "RuuviEngine::loadAlertState:" << e.msg();
+  } catch (const PlatformError& e) {
+    qWarning() << "RuuviEngine::loadAlertState:" << e.msg();
+  }
+}
+
+RuuviEngine::Data RuuviEngine::storedData(const QString& name) const {
+  DataEngine::Data values;
+  try {
+    MeasurementDatabase db("RuuviEngine::storedData", MeasurementDatabase::Mode::ReadOnly);
+    const auto locId = db.locationId(name);
+    if (locId == 0) return values;
+
+    quint32 newest = 0;
+    for (const Metric& metric: Metrics::all) {
+      const auto m = db.latest(locId, metric.id);
+      if (m.ts == 0) continue;
+      values[metric.storageName()] = m.value;
+      newest = std::max(newest, m.ts);
+    }
+    if (newest > 0) {
+      values["timestamp"] = newest;
+      values["stored"] = true;
+    }
+  } catch (const DatabaseError& e) {
+    qWarning() << "RuuviEngine::storedData:" << e.msg();
+  } catch (const PlatformError& e) {
+    qWarning() << "RuuviEngine::storedData:" << e.msg();
+  }
+  return values;
+}
+
 bool RuuviEngine::sourceRequestEvent(const QString& name) {
   qDebug() << "Source request" << name;
   if (!d->m_tags.contains(name)) {
-    setData(name, DataEngine::Data());
+    // Show the stored values until the first advertisement arrives
+    const auto stored = storedData(name);
+    setData(name, stored);
     d->m_tags[name] = nullptr;
+    d->m_lastSeen[name] = stored.value("timestamp").toUInt();
+    loadAlertState(name);
+  }
+  if (d->m_source != nullptr) {
+    return true;
   }
   auto p = d->m_manager->deviceForAddress(name);
   if (p != nullptr) {
@@ -50,6 +50,11 @@ signals:
 private:
 
   bool setDataFromManufacturerData(const QString& name);
+  bool setDataFromPayload(const QString& name, const QByteArray& payload);
+  // The latest values in the measurement database
+  Data storedData(const QString& name) const;
+  // Conditions already raised are not announced again
+  void loadAlertState(const QString& name);
   void scan();
   void stopScanning();
   void setupScan();
@@ -57,8 +62,8 @@ private:
 
   static inline const int StopScanMSecs = 15000;
   static inline const int RefreshStep = 20 * 60 * 1000; // 20 mins
+  static inline const int StaleCheckMSecs = 60 * 1000;
   // static inline const int RefreshStep = 10 * 1000;
-  static inline const int RuuviMID = 1177;
 
 
   struct Private;
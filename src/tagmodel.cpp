@@ -0,0 +1,293 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./src/tagmodel.cpp
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "tagmodel.h"
+#include "measurementdatabase.h"
+#include "statsindex.h"
+#include "changenotifier.h"
+#include <QDateTime>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QDebug>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+// the value roles follow the metric registry order
+static_assert(Metrics::count == 3);
+static_assert(TagModel::TemperatureRole + static_cast<int>(MetricId::Humidity) == TagModel::HumidityRole);
+static_assert(TagModel::TemperatureRole + static_cast<int>(MetricId::Pressure) == TagModel::PressureRole);
+
+static constexpr double nan = std::numeric_limits<double>::quiet_NaN();
+
+// NaN compares unequal to itself
+static bool same(double a, double b) {
+  return a == b || (std::isnan(a) && std::isnan(b));
+}
+
+static bool same(const std::array<double, Metrics::count>& a, const std::array<double, Metrics::count>& b) {
+  for (int i = 0; i < Metrics::count; i++) {
+    if (!same(a[i], b[i])) return false;
+  }
+  return true;
+}
+
+TagModel::TagModel(QObject* parent)
+  : QAbstractListModel(parent)
+  , m_stats(new StatsIndex("TagModel::stats")) {
+  auto listener = new ChangeListener(this);
+  connect(listener, &ChangeListener::changed, this, [this] (const QString& addr, const QString& metric,
+                                                           quint32 from, quint32 to) {
+    m_stats->invalidate(addr, metric, from, to);
+    refresh(addr);
+  });
+}
+
+TagModel::~TagModel() {
+  delete m_stats;
+}
+
+int TagModel::rowCount(const QModelIndex& parent) const {
+  if (parent.isValid()) return 0;
+  return m_rows.size();
+}
+
+QVariant TagModel::data(const QModelIndex& index, int role) const {
+  if (!index.isValid() || index.row() >= m_rows.size()) return QVariant();
+
+  const Row& row = m_rows[index.row()];
+  switch (role) {
+  case AddressRole: return row.address;
+  case NameRole: return row.name;
+  case TemperatureRole:
+  case HumidityRole:
+  case PressureRole:
+    return row.values[role - TemperatureRole];
+  case LastSeenRole: return row.lastSeen;
+  case MinimumRole: return toMap(row.minimum);
+  case MaximumRole: return toMap(row.maximum);
+  default: return QVariant();
+  }
+}
+
+QHash<int, QByteArray> TagModel::roleNames() const {
+  return {
+    {AddressRole, "address"},
+    {NameRole, "name"},
+    {TemperatureRole, "temperature"},
+    {HumidityRole, "humidity"},
+    {PressureRole, "pressure"},
+    {LastSeenRole, "lastSeen"},
+    {MinimumRole, "minimum"},
+    {MaximumRole, "maximum"},
+  };
+}
+
+QString TagModel::devicesJson() const {
+  return m_devicesJson;
+}
+
+quint32 TagModel::window() const {
+  return m_window;
+}
+
+QStringList TagModel::addresses() const {
+  QStringList addrs;
+  for (const Row& row: m_rows) {
+    addrs << row.address;
+  }
+  return addrs;
+}
+
+// Keeps the rows of the tags which stay enabled, so that their
+// delegates are not recreated when the configuration changes
+void TagModel::setDevicesJson(const QString& json) {
+  if (json == m_devicesJson) return;
+  m_devicesJson = json;
+  emit devicesJsonChanged();
+
+  QVector<QPair<QString, QString>> wanted;
+  const auto devices = QJsonDocument::fromJson(json.toUtf8()).array();
+  for (const auto item: devices) {
+    const auto device = item.toObject();
+    if (!device["enabled"].toBool()) continue;
+    wanted << qMakePair(device["address"].toString(), device["location"].toString());
+  }
+
+  const auto before = addresses();
+
+  for (int i = m_rows.size() - 1; i >= 0; i--) {
+    const auto it = std::find_if(wanted.cbegin(), wanted.cend(), [this, i] (const auto& w) {
+      return w.first == m_rows[i].address;
+    });
+    if (it != wanted.cend()) continue;
+    beginRemoveRows(QModelIndex(), i, i);
+    m_rows.removeAt(i);
+    endRemoveRows();
+  }
+
+  for (int i = 0; i < wanted.size(); i++) {
+    const int j = find(wanted[i].first);
+    if (j < 0) {
+      Row row;
+      row.address = wanted[i].first;
+      row.name = wanted[i].second;
+      load(row);
+      beginInsertRows(QModelIndex(), i, i);
+      m_rows.insert(i, row);
+      endInsertRows();
+      continue;
+    }
+    // rows before i are in place, so j >= i
+    if (j > i) {
+      beginMoveRows(QModelIndex(), j, j, QModelIndex(), i);
+      m_rows.move(j, i);
+      endMoveRows();
+    }
+    if (m_rows[i].name != wanted[i].second) {
+      m_rows[i].name = wanted[i].second;
+      emit dataChanged(index(i), index(i), {NameRole});
+    }
+  }
+
+  if (addresses() != before) {
+    emit addressesChanged();
+  }
+}
+
+void TagModel::setWindow(quint32 secs) {
+  if (secs == m_window) return;
+  m_window = secs;
+  emit windowChanged();
+  refresh();
+}
+
+void TagModel::setValues(const QString& address, const QVariantMap& values) {
+  const int i = find(address);
+  if (i < 0) return;
+
+  Row row = m_rows[i];
+  bool found = false;
+  for (const Metric& metric: Metrics::all) {
+    const auto v = values.value(metric.name);
+    if (!v.isValid()) continue;
+    const double value = v.toDouble();
+    const int k = static_cast<int>(metric.id);
+    row.values[k] = value;
+    // the live value extends the stored window limits
+    if (std::isnan(row.minimum[k]) || value < row.minimum[k]) row.minimum[k] = value;
+    if (std::isnan(row.maximum[k]) || value > row.maximum[k]) row.maximum[k] = value;
+    found = true;
+  }
+  if (!found) return;
+
+  const auto ts = values.value("timestamp");
+  row.lastSeen = ts.isValid() ? ts.toUInt() : QDateTime::currentSecsSinceEpoch();
+
+  update(i, row);
+}
+
+void TagModel::refresh() {
+  for (int i = 0; i < m_rows.size(); i++) {
+    Row row = m_rows[i];
+    load(row);
+    update(i, row);
+  }
+}
+
+void TagModel::refresh(const QString& address) {
+  const int i = find(address);
+  if (i < 0) return;
+  Row row = m_rows[i];
+  load(row);
+  update(i, row);
+}
+
+int TagModel::valueRole(MetricId metric) {
+  return TemperatureRole + static_cast<int>(metric);
+}
+
+QVariantMap TagModel::toMap(const Values& values) {
+  QVariantMap r;
+  for (const Metric& metric: Metrics::all) {
+    r[metric.name] = values[static_cast<int>(metric.id)];
+  }
+  return r;
+}
+
+int TagModel::find(const QString& address) const {
+  for (int i = 0; i < m_rows.size(); i++) {
+    if (m_rows[i].address == address) return i;
+  }
+  return -1;
+}
+
+// Stored values replace the current ones only if they are newer
+void TagModel::load(Row& row) {
+  if (row.lastSeen == 0) {
+    row.values.fill(nan);
+  }
+  row.minimum.fill(nan);
+  row.maximum.fill(nan);
+
+  try {
+    MeasurementDatabase db("TagModel::load", MeasurementDatabase::Mode::ReadOnly);
+    const auto locId = db.locationId(row.address);
+    if (locId == 0) return;
+
+    const quint32 now = QDateTime::currentSecsSinceEpoch();
+    quint32 seen = 0;
+    for (const Metric& metric: Metrics::all) {
+      const int k = static_cast<int>(metric.id);
+      const auto m = db.latest(locId, metric.id);
+      if (m.ts > row.lastSeen) {
+        row.values[k] = m.value;
+        seen = std::max(seen, m.ts);
+      }
+      const auto s = m_stats->stats(locId, metric.id, now - std::min(now, m_window), now + 1);
+      if (s.count > 0) {
+        row.minimum[k] = s.min;
+        row.maximum[k] = s.max;
+      }
+    }
+    row.lastSeen = std::max(row.lastSeen, seen);
+  } catch (const DatabaseError& e) {
+    qWarning() << "TagModel::load:" << e.msg();
+  }
+}
+
+void TagModel::update(int i, const Row& row) {
+  Row& old = m_rows[i];
+  QVector<int> roles;
+  for (const Metric& metric: Metrics::all) {
+    const int k = static_cast<int>(metric.id);
+    if (!same(old.values[k], row.values[k])) {
+      roles << valueRole(metric.id);
+    }
+  }
+  if (old.lastSeen != row.lastSeen) roles << LastSeenRole;
+  if (!same(old.minimum, row.minimum)) roles << MinimumRole;
+  if (!same(old.maximum, row.maximum)) roles << MaximumRole;
+
+  old = row;
+  if (!roles.isEmpty()) {
+    emit dataChanged(index(i), index(i), roles);
+  }
+}
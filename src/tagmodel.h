@@ -0,0 +1,104 @@
+/* -*- coding: utf-8-unix -*-
+ *
+ * File: ./src/tagmodel.h
+ *
+ * Copyright (C) 2022 Jukka Sirkka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <QAbstractListModel>
+#include <QVector>
+#include <array>
+#include "metrics.h"
+
+class StatsIndex;
+
+// One row per enabled tag with the latest values, the time they were
+// measured and the min/max over the last window seconds. Rows are
+// updated in place, dataChanged names only the roles which changed.
+class TagModel: public QAbstractListModel {
+
+  Q_OBJECT
+
+  Q_PROPERTY(QString devicesJson READ devicesJson WRITE setDevicesJson NOTIFY devicesJsonChanged)
+  Q_PROPERTY(quint32 window READ window WRITE setWindow NOTIFY windowChanged)
+  Q_PROPERTY(QStringList addresses READ addresses NOTIFY addressesChanged)
+
+public:
+
+  enum Roles {
+    AddressRole = Qt::UserRole + 1,
+    NameRole,
+    TemperatureRole,
+    HumidityRole,
+    PressureRole,
+    LastSeenRole,
+    MinimumRole,
+    MaximumRole,
+  };
+
+  TagModel(QObject* parent = nullptr);
+  ~TagModel();
+
+  int rowCount(const QModelIndex& parent = QModelIndex()) const override;
+  QVariant data(const QModelIndex& index, int role) const override;
+  QHash<int, QByteArray> roleNames() const override;
+
+  QString devicesJson() const;
+  void setDevicesJson(const QString& json);
+  quint32 window() const;
+  void setWindow(quint32 secs);
+  QStringList addresses() const;
+
+  // Live values from the data engine
+  Q_INVOKABLE void setValues(const QString& address, const QVariantMap& values);
+  // Reloads the stored values and window limits of all rows
+  Q_INVOKABLE void refresh();
+
+signals:
+
+  void devicesJsonChanged();
+  void windowChanged();
+  void addressesChanged();
+
+private:
+
+  using Values = std::array<double, Metrics::count>;
+
+  struct Row {
+    QString address;
+    QString name;
+    Values values;
+    quint32 lastSeen = 0;
+    Values minimum;
+    Values maximum;
+  };
+
+  static int valueRole(MetricId metric);
+  static QVariantMap toMap(const Values& values);
+
+  int find(const QString& address) const;
+  void load(Row& row);
+  void update(int index, const Row& row);
+  void refresh(const QString& address);
+
+  static inline const quint32 DefaultWindow = 24 * 3600;
+
+  QString m_devicesJson;
+  quint32 m_window = DefaultWindow;
+  QVector<Row> m_rows;
+  StatsIndex* const m_stats;
+};